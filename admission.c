@@ -0,0 +1,211 @@
+/* @file admission.c
+ * @brief Source file for admission control of background processes. New
+ * background processes are held in the bgqueue while the host is short on
+ * resources: while the pressure stall information of cpu, memory or io
+ * (the "some avg10" share of time tasks were stalled, from /proc/pressure)
+ * is over its threshold, or MemAvailable is under its threshold. The /proc
+ * files are kept open and only the line that is needed is read, with one
+ * pread, and a reading is reused for READING_TTL_MS, so checking before
+ * every instance of a large bgn is cheap.
+ */
+
+#include "admission.h"
+#include "utils.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// how long a reading of the /proc files is reused for
+#define READING_TTL_MS 100
+
+enum resource { RES_CPU, RES_MEMORY, RES_IO, N_PRESSURE };
+
+static const char *res_names[] = {"cpu", "memory", "io"};
+static const char *pressure_paths[] = {"/proc/pressure/cpu",
+                                       "/proc/pressure/memory",
+                                       "/proc/pressure/io"};
+
+// max "some avg10" pressure of each resource in percent, 0 for no limit
+static double max_pressure[N_PRESSURE];
+// min MemAvailable in MB, 0 for no limit
+static long min_avail_mb = 0;
+// open /proc files, -1 before they are first read, -2 if they can't be
+static int pressure_fds[N_PRESSURE] = {-1, -1, -1};
+static int meminfo_fd = -1;
+// last reading, and the monotonic time it was taken at
+static double pressure[N_PRESSURE];
+static long avail_mb = -1;
+static long long read_ns = 0;
+// why launches are held, empty if they aren't
+static char reason[100];
+
+/* reads the start of a /proc file into buf, opening it on first use.
+ * returns: the number of bytes read, -1 if the file can't be read
+ */
+static int read_proc(int *fd, const char *path, char *buf, int size) {
+  if (*fd == -1) {
+    *fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (*fd == -1) {
+      *fd = -2;
+      return -1;
+    }
+  }
+  if (*fd < 0)
+    return -1;
+  int n = pread(*fd, buf, size - 1, 0);
+  if (n < 0)
+    return -1;
+  buf[n] = '\0';
+  return n;
+}
+
+/* returns the "some avg10" pressure of a resource, -1 if it's unavailable */
+static double read_pressure(enum resource res) {
+  // the "some" line comes first, nothing after it is needed
+  char buf[80];
+  if (read_proc(&pressure_fds[res], pressure_paths[res], buf, sizeof(buf)) ==
+      -1)
+    return -1;
+  char *avg10 = strstr(buf, "avg10=");
+  return avg10 != NULL ? strtod(avg10 + 6, NULL) : -1;
+}
+
+/* returns MemAvailable in MB, -1 if it's unavailable */
+static long read_avail() {
+  // MemAvailable is the third line of /proc/meminfo
+  char buf[256];
+  if (read_proc(&meminfo_fd, "/proc/meminfo", buf, sizeof(buf)) == -1)
+    return -1;
+  char *avail = strstr(buf, "MemAvailable:");
+  return avail != NULL ? strtol(avail + 13, NULL, 10) / 1024 : -1;
+}
+
+/* takes a new reading of the resources that have a threshold, and updates
+ * the reason launches are held for.
+ */
+static void take_reading() {
+  reason[0] = '\0';
+  for (int i = 0; i < N_PRESSURE; i++) {
+    pressure[i] = max_pressure[i] > 0 ? read_pressure(i) : -1;
+    if (reason[0] == '\0' && pressure[i] > max_pressure[i] &&
+        max_pressure[i] > 0)
+      snprintf(reason, sizeof(reason), "%s pressure %.2f%% is over %.2f%%",
+               res_names[i], pressure[i], max_pressure[i]);
+  }
+  avail_mb = min_avail_mb > 0 ? read_avail() : -1;
+  if (reason[0] == '\0' && avail_mb != -1 && avail_mb < min_avail_mb)
+    snprintf(reason, sizeof(reason), "MemAvailable %ld MB is under %ld MB",
+             avail_mb, min_avail_mb);
+  read_ns = monotonic_ns();
+}
+
+/* Checks if a new background process may be started now.
+ * returns: NULL if it may, otherwise why it has to be held, valid until
+ *          the next call
+ */
+const char *admit_check() {
+  if (min_avail_mb == 0 && max_pressure[RES_CPU] == 0 &&
+      max_pressure[RES_MEMORY] == 0 && max_pressure[RES_IO] == 0) {
+    reason[0] = '\0';
+    return NULL;
+  }
+  if (monotonic_ns() - read_ns >= READING_TTL_MS * 1000000LL)
+    take_reading();
+  return reason[0] != '\0' ? reason : NULL;
+}
+
+/* returns why new background processes were held at the last check, NULL
+ * if they weren't.
+ */
+const char *held_reason() { return reason[0] != '\0' ? reason : NULL; }
+
+/* Sets the threshold of a resource, 0 removes it.
+ * inputs: name - cpu, memory or io for a max pressure in percent, or
+ *                memavail for a min MemAvailable in MB
+ *         value - the threshold
+ * returns: 0 on success, -1 if name or value is invalid
+ */
+int admit_set(const char *name, const char *value) {
+  char *end;
+  double limit = strtod(value, &end);
+  if (end == value || *end != '\0' || limit < 0)
+    return -1;
+  if (strcmp(name, "memavail") == 0) {
+    min_avail_mb = limit;
+  } else {
+    int i = 0;
+    while (i < N_PRESSURE && strcmp(name, res_names[i]) != 0)
+      i++;
+    if (i == N_PRESSURE || limit > 100)
+      return -1;
+    max_pressure[i] = limit;
+  }
+  // the next check takes a reading with the new thresholds
+  read_ns = 0;
+  return 0;
+}
+
+/* Sets thresholds from a comma separated list of name=value, like
+ * "memory=20,memavail=512", see admit_set.
+ * returns: 0 on success, -1 if any of them is invalid
+ */
+int admit_parse(const char *spec) {
+  char buf[200];
+  snprintf(buf, sizeof(buf), "%s", spec);
+  int result = 0;
+  char *save;
+  for (char *tok = strtok_r(buf, ",", &save); tok != NULL;
+       tok = strtok_r(NULL, ",", &save)) {
+    char *value = strchr(tok, '=');
+    if (value == NULL) {
+      result = -1;
+      continue;
+    }
+    *value = '\0';
+    if (admit_set(tok, value + 1) == -1)
+      result = -1;
+  }
+  return result;
+}
+
+/* prints the thresholds, the current reading and whether new background
+ * processes are held.
+ */
+void print_admission() {
+  const char *held = admit_check();
+  for (int i = 0; i < N_PRESSURE; i++) {
+    if (max_pressure[i] == 0)
+      printf("  %-8s pressure: no limit\n", res_names[i]);
+    else if (pressure[i] < 0)
+      printf("  %-8s pressure: unavailable, limit %.2f%%\n", res_names[i],
+             max_pressure[i]);
+    else
+      printf("  %-8s pressure: %.2f%%, limit %.2f%%\n", res_names[i],
+             pressure[i], max_pressure[i]);
+  }
+  if (min_avail_mb == 0)
+    printf("  MemAvailable:     no limit\n");
+  else if (avail_mb < 0)
+    printf("  MemAvailable:     unavailable, limit %ld MB\n", min_avail_mb);
+  else
+    printf("  MemAvailable:     %ld MB, limit %ld MB\n", avail_mb,
+           min_avail_mb);
+  if (held != NULL)
+    printf("New background processes are held: %s\n", held);
+  else
+    printf("New background processes are admitted\n");
+}
+
+/* closes the /proc files */
+void admit_close() {
+  for (int i = 0; i < N_PRESSURE; i++) {
+    if (pressure_fds[i] >= 0)
+      close(pressure_fds[i]);
+    pressure_fds[i] = -1;
+  }
+  if (meminfo_fd >= 0)
+    close(meminfo_fd);
+  meminfo_fd = -1;
+}
@@ -0,0 +1,15 @@
+/* @file admission.h
+ * @brief Header file for admission control of background processes
+ */
+
+#ifndef _ADMISSION_H_
+#define _ADMISSION_H_
+
+const char *admit_check();
+const char *held_reason();
+int admit_set(const char *name, const char *value);
+int admit_parse(const char *spec);
+void print_admission();
+void admit_close();
+
+#endif
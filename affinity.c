@@ -0,0 +1,193 @@
+/* @file affinity.c
+ * @brief Source file for cpu placement of background processes. Picks the
+ * cpu (or NUMA node) a new background process is pinned to, according to
+ * the selected placement policy.
+ */
+
+#define _GNU_SOURCE
+#include "affinity.h"
+#include "list.h"
+#include "sampler.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// the least loaded cpu is chosen from loads computed at most this often
+#define LOAD_REFRESH_NS 1000000000LL
+// load assumed for a process placed since the loads were computed
+#define NEW_JOB_LOAD 100.0
+
+static enum place_policy policy = PLACE_NONE;
+static const char *policy_names[] = {"none", "rr", "least", "numa"};
+
+// cpus PMan may run on, and the NUMA nodes they belong to.
+// filled in on the first placement.
+static int initialized = 0;
+static int n_cpus = 0;
+static int *cpus = NULL;
+static int n_nodes = 0;
+static int *node_ids = NULL;
+static cpu_set_t *node_sets = NULL;
+
+// state of the policies: next cpu / node in turn, and cpu loads
+static int next_cpu = 0;
+static int next_node = 0;
+static double *loads = NULL;
+static long long loads_ns = 0;
+
+/* reads the cpus PMan is allowed to run on and the NUMA nodes from sysfs.
+ * Nodes without any allowed cpu are skipped. Without NUMA information
+ * all allowed cpus are treated as one node.
+ */
+static void init_topology() {
+  cpu_set_t allowed;
+  initialized = 1;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+    return;
+  n_cpus = CPU_COUNT(&allowed);
+  cpus = malloc(n_cpus * sizeof(int));
+  loads = calloc(n_cpus, sizeof(double));
+  node_ids = malloc(CPU_SETSIZE * sizeof(int));
+  node_sets = malloc(CPU_SETSIZE * sizeof(cpu_set_t));
+  if (cpus == NULL || loads == NULL || node_ids == NULL || node_sets == NULL) {
+    fprintf(stderr, "Error: malloc failed in init_topology");
+    exit(1);
+  }
+  for (int cpu = 0, i = 0; cpu < CPU_SETSIZE && i < n_cpus; cpu++) {
+    if (CPU_ISSET(cpu, &allowed))
+      cpus[i++] = cpu;
+  }
+
+  char path[64], list[1024];
+  for (int node = 0; node < CPU_SETSIZE; node++) {
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             node);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+      break;
+    char *line = fgets(list, sizeof(list), fp);
+    fclose(fp);
+    if (line == NULL)
+      continue;
+    // cpulist is a comma separated list of cpus and cpu ranges: "0-3,8-11"
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (char *range = strtok(list, ",\n"); range != NULL;
+         range = strtok(NULL, ",\n")) {
+      int first, last;
+      int n = sscanf(range, "%d-%d", &first, &last);
+      if (n < 1)
+        continue;
+      if (n == 1)
+        last = first;
+      for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+        CPU_SET(cpu, &set);
+    }
+    CPU_AND(&set, &set, &allowed);
+    if (CPU_COUNT(&set) > 0) {
+      node_ids[n_nodes] = node;
+      node_sets[n_nodes++] = set;
+    }
+  }
+  if (n_nodes == 0) {
+    node_ids[n_nodes] = 0;
+    node_sets[n_nodes++] = allowed;
+  }
+}
+
+/* returns the index into cpus of the given cpu, -1 if it isn't allowed */
+static int cpu_index(int cpu) {
+  for (int i = 0; i < n_cpus; i++) {
+    if (cpus[i] == cpu)
+      return i;
+  }
+  return -1;
+}
+
+/* recomputes the load of every cpu as the sum of the recent cpu usage of
+ * the processes pinned to it. Processes that haven't been sampled twice yet
+ * are assumed to be busy.
+ */
+static void refresh_loads(plist_t *processes) {
+  long long now = monotonic_ns();
+  if (now - loads_ns < LOAD_REFRESH_NS)
+    return;
+  loads_ns = now;
+  memset(loads, 0, n_cpus * sizeof(double));
+  sample_all(processes);
+  for (process_t *cur = processes->head; cur != NULL; cur = cur->next) {
+    int i = cur->cpu >= 0 ? cpu_index(cur->cpu) : -1;
+    if (i == -1)
+      continue;
+    double cpu = stats_cpu(cur->stats, 1);
+    loads[i] += cpu < 0 ? NEW_JOB_LOAD : cpu;
+  }
+}
+
+/* selects the placement policy for new background processes */
+void set_placement(enum place_policy new_policy) { policy = new_policy; }
+
+/* returns the current placement policy */
+enum place_policy get_placement() { return policy; }
+
+/* returns the name of a placement policy */
+const char *placement_name(enum place_policy p) { return policy_names[p]; }
+
+/* parses a placement policy name: none, rr, least or numa.
+ * returns: 0 on success, -1 if the name is invalid
+ */
+int parse_placement(const char *name, enum place_policy *p) {
+  for (int i = 0; i < 4; i++) {
+    if (strcmp(name, policy_names[i]) == 0) {
+      *p = i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/* Chooses where the next background process runs.
+ * inputs: processes - the background processes, used for cpu loads
+ *         place - set to the chosen cpu/node and the matching cpu set
+ * returns: 1 if the process should be pinned to place->set, 0 if it
+ *          keeps the default affinity
+ */
+int choose_placement(plist_t *processes, placement_t *place) {
+  place->cpu = -1;
+  place->node = -1;
+  if (policy == PLACE_NONE)
+    return 0;
+  if (!initialized)
+    init_topology();
+  if (n_cpus == 0)
+    return 0;
+
+  int i = 0;
+  switch (policy) {
+  case PLACE_RR:
+    i = next_cpu++ % n_cpus;
+    break;
+  case PLACE_LEAST:
+    refresh_loads(processes);
+    for (int j = 1; j < n_cpus; j++) {
+      if (loads[j] < loads[i])
+        i = j;
+    }
+    // count the new process right away, so a batch of launches
+    // spreads out instead of piling onto the same cpu.
+    loads[i] += NEW_JOB_LOAD;
+    break;
+  case PLACE_NUMA:
+    i = next_node++ % n_nodes;
+    place->node = node_ids[i];
+    place->set = node_sets[i];
+    return 1;
+  default:
+    return 0;
+  }
+  place->cpu = cpus[i];
+  CPU_ZERO(&place->set);
+  CPU_SET(place->cpu, &place->set);
+  return 1;
+}
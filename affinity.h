@@ -0,0 +1,32 @@
+/* @file affinity.h
+ * @brief Header file for cpu placement of background processes
+ */
+
+#include "list.h"
+#include <sched.h>
+
+#ifndef _AFFINITY_H_
+#define _AFFINITY_H_
+
+// how background processes are placed on cpus:
+// PLACE_NONE  - default affinity, the kernel decides
+// PLACE_RR    - pinned to single cpus, taken in turn
+// PLACE_LEAST - pinned to the cpu with the least recent cpu usage
+// PLACE_NUMA  - pinned to all cpus of one NUMA node, nodes taken in turn
+enum place_policy { PLACE_NONE, PLACE_RR, PLACE_LEAST, PLACE_NUMA };
+
+// where a process was placed, cpu and node are -1 when not pinned
+typedef struct placement_t {
+  int cpu;
+  int node;
+  cpu_set_t set;
+
+} placement_t;
+
+void set_placement(enum place_policy policy);
+enum place_policy get_placement();
+const char *placement_name(enum place_policy policy);
+int parse_placement(const char *name, enum place_policy *policy);
+int choose_placement(plist_t *processes, placement_t *place);
+
+#endif
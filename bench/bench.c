@@ -0,0 +1,102 @@
+/* @file bench.c
+ * @brief Source file for the timing and reporting helpers shared by the
+ * benchmarks. Every result is printed as one JSON object per line, so runs
+ * from different commits can be compared by a script.
+ */
+
+#include "bench.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// where results are written, stdout unless bench_quiet was called
+static FILE *results = NULL;
+
+/* returns the current monotonic time in nanoseconds */
+long long bench_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* sends stdout to /dev/null, keeping the results on the original stdout.
+ * Used by benchmarks of code that prints its own messages.
+ */
+void bench_quiet() {
+  fflush(stdout);
+  int fd = dup(STDOUT_FILENO);
+  int null = open("/dev/null", O_WRONLY);
+  if (fd == -1 || null == -1 || (results = fdopen(fd, "w")) == NULL) {
+    perror("bench_quiet");
+    exit(1);
+  }
+  dup2(null, STDOUT_FILENO);
+  close(null);
+}
+
+/* initializes an empty set of samples */
+void samples_init(samples_t *s) {
+  s->v = NULL;
+  s->len = 0;
+  s->cap = 0;
+}
+
+/* adds a sample, growing the array as needed */
+void samples_add(samples_t *s, double ns) {
+  if (s->len == s->cap) {
+    s->cap = s->cap ? s->cap * 2 : 1024;
+    s->v = realloc(s->v, s->cap * sizeof(double));
+    if (s->v == NULL) {
+      fprintf(stderr, "Error: realloc failed in samples_add");
+      exit(1);
+    }
+  }
+  s->v[s->len++] = ns;
+}
+
+/* frees the samples, leaving the set empty */
+void samples_free(samples_t *s) {
+  free(s->v);
+  samples_init(s);
+}
+
+/* compares doubles, for qsort */
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/* nearest rank percentile of sorted samples, p between 0 and 100 */
+static double percentile(samples_t *s, double p) {
+  int i = (int)(p / 100 * s->len + 0.5) - 1;
+  if (i < 0)
+    i = 0;
+  if (i >= s->len)
+    i = s->len - 1;
+  return s->v[i];
+}
+
+/* Prints the distribution of a benchmark's samples as a line of JSON:
+ * {"bench": name, "n": n, "samples": .., "mean": .., "min": .., "p50": ..,
+ *  "p90": .., "p99": .., "max": .., "unit": "ns"}
+ * inputs: name - what was measured
+ *         n - size of the benchmark (entries in the list, jobs, lines...)
+ *         s - the samples, sorted in place
+ */
+void bench_report(const char *name, long n, samples_t *s) {
+  FILE *out = results ? results : stdout;
+  if (s->len == 0)
+    return;
+  qsort(s->v, s->len, sizeof(double), cmp_double);
+  double sum = 0;
+  for (int i = 0; i < s->len; i++)
+    sum += s->v[i];
+  fprintf(out,
+          "{\"bench\": \"%s\", \"n\": %ld, \"samples\": %d, \"mean\": %.1f, "
+          "\"min\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, "
+          "\"max\": %.1f, \"unit\": \"ns\"}\n",
+          name, n, s->len, sum / s->len, s->v[0], percentile(s, 50),
+          percentile(s, 90), percentile(s, 99), s->v[s->len - 1]);
+  fflush(out);
+}
@@ -0,0 +1,26 @@
+/* @file bench.h
+ * @brief Header file for the timing and reporting helpers shared by the
+ * benchmarks
+ */
+
+#include <stdio.h>
+
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+// a growable set of timing samples, in nanoseconds
+typedef struct samples_t {
+  double *v;
+  int len;
+  int cap;
+
+} samples_t;
+
+long long bench_ns();
+void bench_quiet();
+void samples_init(samples_t *s);
+void samples_add(samples_t *s, double ns);
+void samples_free(samples_t *s);
+void bench_report(const char *name, long n, samples_t *s);
+
+#endif
@@ -0,0 +1,122 @@
+/* @file list_bench.c
+ * @brief Microbenchmarks for the process list operations
+ */
+
+#include "../list.h"
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// operations are timed in groups, since one of them takes about as long
+// as reading the clock. Each sample is the average of a group.
+#define GROUP 32
+// times the whole list is walked, each walk is one sample
+#define WALKS 20
+
+/* shuffles pids so lookups and removals don't follow insertion order */
+static void shuffle(int *pids, int n) {
+  for (int i = n - 1; i > 0; i--) {
+    int j = rand() % (i + 1);
+    int tmp = pids[i];
+    pids[i] = pids[j];
+    pids[j] = tmp;
+  }
+}
+
+/* checks there is room for n processes in memory, so the largest
+ * sizes are skipped rather than pushing the machine into swap.
+ */
+static int fits_in_memory(int n) {
+  double avail = (double)sysconf(_SC_AVPHYS_PAGES) * sysconf(_SC_PAGESIZE);
+  return avail > 2.0 * n * sizeof(process_t);
+}
+
+/* times add_at_end, get_process, contains_pid and remove_by_pid on a list
+ * of n processes, and walking it like bglist does, reporting the
+ * distribution of ns per operation (or per process walked) of each.
+ */
+static void bench_list(int n) {
+  if (!fits_in_memory(n)) {
+    fprintf(stderr, "list: skipping n=%d, not enough memory\n", n);
+    return;
+  }
+  int *pids = malloc(n * sizeof(int));
+  // pids handed out by the kernel are mostly sequential
+  for (int i = 0; i < n; i++)
+    pids[i] = 1000 + i;
+
+  char name[LINE_MAX] = "bench";
+  samples_t add, walk, get, miss, rem;
+  samples_init(&add);
+  samples_init(&walk);
+  samples_init(&get);
+  samples_init(&miss);
+  samples_init(&rem);
+  plist_t *list = create_list();
+  for (int i = 0; i < n; i += GROUP) {
+    int end = i + GROUP < n ? i + GROUP : n;
+    long long start = bench_ns();
+    for (int j = i; j < end; j++)
+      add_at_end(list, new_node(pids[j], name, ACTIVE));
+    samples_add(&add, (double)(bench_ns() - start) / (end - i));
+  }
+
+  long chars = 0;
+  for (int i = 0; i < WALKS; i++) {
+    long long start = bench_ns();
+    for (process_t *cur = list->head; cur != NULL; cur = cur->next)
+      chars += cur->pid + cur->state + cur->name[0];
+    samples_add(&walk, (double)(bench_ns() - start) / n);
+  }
+  if (chars == 0)
+    fprintf(stderr, "list: n=%d empty walk\n", n);
+
+  shuffle(pids, n);
+  long found = 0;
+  for (int i = 0; i < n; i += GROUP) {
+    int end = i + GROUP < n ? i + GROUP : n;
+    long long start = bench_ns();
+    for (int j = i; j < end; j++)
+      found += get_process(list, pids[j]) != NULL;
+    samples_add(&get, (double)(bench_ns() - start) / (end - i));
+  }
+
+  for (int i = 0; i < n; i += GROUP) {
+    int end = i + GROUP < n ? i + GROUP : n;
+    long long start = bench_ns();
+    for (int j = i; j < end; j++)
+      found += contains_pid(list, pids[j] + n);
+    samples_add(&miss, (double)(bench_ns() - start) / (end - i));
+  }
+
+  for (int i = 0; i < n; i += GROUP) {
+    int end = i + GROUP < n ? i + GROUP : n;
+    long long start = bench_ns();
+    for (int j = i; j < end; j++)
+      remove_by_pid(list, pids[j]);
+    samples_add(&rem, (double)(bench_ns() - start) / (end - i));
+  }
+  if (found != n || list->size != 0)
+    fprintf(stderr, "list: n=%d found %ld, %d left\n", n, found, list->size);
+
+  bench_report("list.add_at_end", n, &add);
+  bench_report("list.walk", n, &walk);
+  bench_report("list.get_process", n, &get);
+  bench_report("list.contains_pid_miss", n, &miss);
+  bench_report("list.remove_by_pid", n, &rem);
+  samples_free(&add);
+  samples_free(&walk);
+  samples_free(&get);
+  samples_free(&miss);
+  samples_free(&rem);
+  free_list(list);
+  free(pids);
+}
+
+int main() {
+  int sizes[] = {1000, 10000, 100000, 1000000};
+  for (int i = 0; i < 4; i++)
+    bench_list(sizes[i]);
+  return 0;
+}
@@ -0,0 +1,150 @@
+/* @file proc_bench.c
+ * @brief End to end benchmarks of starting and reaping background processes,
+ * and of feeding commands to PMan in batch mode
+ */
+
+#define _GNU_SOURCE
+#include "../event.h"
+#include "../list.h"
+#include "../process.h"
+#include "../sampler.h"
+#include "bench.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SPAWNS 500
+#define REAP_ROUNDS 100
+#define INGEST_LINES 20000
+#define INGEST_RUNS 20
+
+extern char **environ;
+
+/* waits until every process in the list has exited and is a zombie,
+ * so check_processes can reap them all without waiting.
+ */
+static void wait_zombies(plist_t *processes) {
+  struct timespec pause = {0, 100000};
+  for (process_t *cur = processes->head; cur != NULL;) {
+    pstat_t st;
+    if (read_pstat(cur->pid, &st) == -1 || st.state == 'Z') {
+      cur = cur->next;
+    } else {
+      nanosleep(&pause, NULL);
+    }
+  }
+}
+
+/* times fork_process starting a background 'true' with the given backend */
+static void bench_spawn(enum spawn_backend backend, const char *name) {
+  char *args[] = {"true", NULL};
+  samples_t s;
+  samples_init(&s);
+  set_spawn_backend(backend);
+  plist_t *processes = create_list();
+  for (int i = 0; i < SPAWNS; i++) {
+    long long start = bench_ns();
+    int pid = fork_process(args, processes, BG);
+    long long end = bench_ns();
+    if (pid == -1) {
+      fprintf(stderr, "%s: fork_process failed\n", name);
+      exit(1);
+    }
+    samples_add(&s, end - start);
+    wait_zombies(processes);
+    check_processes(processes);
+  }
+  bench_report(name, SPAWNS, &s);
+  samples_free(&s);
+  free_list(processes);
+}
+
+/* times check_processes reaping 'count' exited background processes at
+ * once, reporting the ns per reaped process.
+ */
+static void bench_reap(int count) {
+  char *args[] = {"true", NULL};
+  samples_t s;
+  samples_init(&s);
+  plist_t *processes = create_list();
+  for (int i = 0; i < REAP_ROUNDS; i++) {
+    for (int j = 0; j < count; j++)
+      fork_process(args, processes, BG);
+    wait_zombies(processes);
+    long long start = bench_ns();
+    int reaped = check_processes(processes);
+    long long end = bench_ns();
+    if (reaped != count) {
+      fprintf(stderr, "reap: reaped %d of %d\n", reaped, count);
+      exit(1);
+    }
+    samples_add(&s, (double)(end - start) / count);
+  }
+  bench_report("reap.check_processes", count, &s);
+  samples_free(&s);
+  free_list(processes);
+}
+
+/* times PMan running a script of INGEST_LINES commands with -f, reporting
+ * the ns per line of each run. The script only lists the (empty) process
+ * list, so it measures reading, parsing and dispatching commands.
+ */
+static void bench_ingest(char *pman) {
+  char path[] = "/tmp/pman-bench-XXXXXX";
+  int fd = mkstemp(path);
+  FILE *script = fd == -1 ? NULL : fdopen(fd, "w");
+  if (script == NULL) {
+    perror("mkstemp");
+    exit(1);
+  }
+  for (int i = 0; i < INGEST_LINES; i++)
+    fprintf(script, i % 4 ? "bglist\n" : "# comment\n");
+  fclose(script);
+
+  samples_t s;
+  samples_init(&s);
+  char *args[] = {pman, "-f", path, NULL};
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null",
+                                   O_WRONLY, 0);
+  for (int i = 0; i < INGEST_RUNS; i++) {
+    pid_t pid;
+    int status;
+    long long start = bench_ns();
+    if (posix_spawn(&pid, pman, &actions, NULL, args, environ) != 0) {
+      fprintf(stderr, "ingest: couldn't run %s\n", pman);
+      exit(1);
+    }
+    waitpid(pid, &status, 0);
+    samples_add(&s, (double)(bench_ns() - start) / INGEST_LINES);
+  }
+  bench_report("ingest.batch_line", INGEST_LINES, &s);
+  posix_spawn_file_actions_destroy(&actions);
+  samples_free(&s);
+  unlink(path);
+}
+
+int main(int argc, char *argv[]) {
+  // the benchmarks measure starting processes, not capturing their output
+  setenv("PMAN_CAPTURE", "0", 1);
+  // check_processes reaps children itself, SIGCHLD is never handled
+  signal(SIGCHLD, SIG_DFL);
+  if (ev_init() == -1) {
+    perror("ev_init");
+    exit(1);
+  }
+  bench_quiet();
+  bench_spawn(SPAWN_POSIX, "spawn.posix_spawn");
+  bench_spawn(SPAWN_FORK, "spawn.fork");
+  bench_reap(1);
+  bench_reap(32);
+  bench_ingest(argc > 1 ? argv[1] : "./pman");
+  return 0;
+}
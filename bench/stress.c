@@ -0,0 +1,504 @@
+/* @file stress.c
+ * @brief Stress test of PMan under a high rate of randomized commands.
+ * Starts PMan (built with AddressSanitizer by make stress) with a control
+ * socket and PMAN_CHECK set, so it checks its process lists after every
+ * event, and pipelines a random mix of bg, bgkill, bgstop, bgstart, range
+ * signals, bglist and pstat requests at it for a number of seconds, while
+ * thousands of short and long lived children come and go. Some commands go
+ * through PMan's stdin instead, so both paths are exercised.
+ *
+ * Long lived children are tracked, and are only ever killed by this
+ * harness, so every request naming one of them has to succeed. Once a
+ * second PMan's children are scanned in /proc, and a zombie seen in two
+ * scans in a row was left unreaped. At the end the list size PMan reports
+ * has to match the tracked children, PMan has to exit cleanly (ASan fails
+ * the exit on any leak), and nothing it started may be left running.
+ *
+ * Prints the request latencies like the benchmarks, then a summary with the
+ * sustained requests per second, and exits 1 if any check failed.
+ * Usage: stress [pman] [seconds] [children]
+ */
+
+#define _GNU_SOURCE
+#include "bench.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char **environ;
+
+// requests sent without waiting for their replies
+#define WINDOW 32
+#define MAX_REQUEST 128
+// how often PMan's children are scanned for zombies, in ms
+#define SCAN_MS 1000
+// how long PMan gets to exit after quit, in ms
+#define EXIT_TIMEOUT_MS 30000
+
+enum req_type { REQ_BG_SHORT, REQ_BG_LONG, REQ_TRACKED, REQ_OTHER };
+
+// a request waiting for its reply, replies come back in order
+typedef struct request {
+  enum req_type type;
+  pid_t pid;
+  long long sent_ns;
+
+} request;
+
+typedef struct stress_t {
+  pid_t pman;
+  int sock;
+  int input;
+  // pids of the long lived children, which only this harness kills
+  pid_t *tracked;
+  int n_tracked;
+  int max_tracked;
+  // ring of requests waiting for replies
+  request window[WINDOW];
+  int first;
+  int pending;
+  // replies read but not handled yet
+  char in[1 << 16];
+  int in_len;
+  // zombies found by the last scan
+  pid_t *zombies;
+  int n_zombies;
+  // the last reply, for ask
+  char last[4096];
+  samples_t latency;
+  long ops;
+  long started;
+  long bg_failed;
+  long unexpected;
+  long unreaped;
+  int peak;
+
+} stress_t;
+
+/* returns a random number from 0 to n - 1 */
+static int rnd(int n) { return rand() % n; }
+
+/* adds a tracked child */
+static void track(stress_t *s, pid_t pid) {
+  if (s->n_tracked == s->max_tracked) {
+    s->max_tracked = s->max_tracked ? s->max_tracked * 2 : 1024;
+    s->tracked = realloc(s->tracked, s->max_tracked * sizeof(pid_t));
+    if (s->tracked == NULL) {
+      fprintf(stderr, "Error: realloc failed in track");
+      exit(1);
+    }
+  }
+  s->tracked[s->n_tracked++] = pid;
+}
+
+/* removes the tracked child at index i and returns its pid */
+static pid_t untrack(stress_t *s, int i) {
+  pid_t pid = s->tracked[i];
+  s->tracked[i] = s->tracked[--s->n_tracked];
+  return pid;
+}
+
+/* sends a request on the control socket and remembers it */
+static void send_request(stress_t *s, enum req_type type, pid_t pid,
+                         const char *line) {
+  int len = strlen(line), sent = 0;
+  while (sent < len) {
+    int n = write(s->sock, line + sent, len - sent);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1) {
+      fprintf(stderr, "stress: lost the control socket: %s\n",
+              strerror(errno));
+      return;
+    }
+    sent += n;
+  }
+  request *req = &s->window[(s->first + s->pending) % WINDOW];
+  req->type = type;
+  req->pid = pid;
+  req->sent_ns = bench_ns();
+  s->pending++;
+}
+
+/* writes a command to PMan's stdin, unless the pipe is full */
+static void send_input(stress_t *s, const char *line) {
+  if (write(s->input, line, strlen(line)) > 0)
+    s->ops++;
+}
+
+/* sends one random request, or command on stdin */
+static void random_op(stress_t *s, int children) {
+  char line[MAX_REQUEST];
+  int r = rnd(100);
+  if (s->n_tracked == 0 || r < 40) {
+    // half stay until killed (up to 'children' of them), the rest exit at
+    // once or within a second
+    if (s->n_tracked < children && rnd(2)) {
+      send_request(s, REQ_BG_LONG, 0, "bg sleep 600\n");
+    } else if (rnd(2)) {
+      snprintf(line, sizeof(line), "bg sleep 0.%d\n", rnd(10));
+      send_request(s, REQ_BG_SHORT, 0, line);
+    } else {
+      send_request(s, REQ_BG_SHORT, 0, "bg true\n");
+    }
+    return;
+  }
+  int i = rnd(s->n_tracked);
+  pid_t pid = s->tracked[i];
+  if (r < 46) {
+    // nothing names it after this, so it's untracked right away
+    untrack(s, i);
+    snprintf(line, sizeof(line), "bgkill %d\n", pid);
+    send_request(s, REQ_TRACKED, pid, line);
+  } else if (r < 62) {
+    snprintf(line, sizeof(line), "bgstop %d\n", pid);
+    send_request(s, REQ_TRACKED, pid, line);
+  } else if (r < 78) {
+    snprintf(line, sizeof(line), "bgstart %d\n", pid);
+    send_request(s, REQ_TRACKED, pid, line);
+  } else if (r < 86) {
+    // ranges also hit short lived children that are exiting
+    snprintf(line, sizeof(line), "%s %d-%d\n", rnd(2) ? "bgstop" : "bgstart",
+             pid - rnd(64), pid + rnd(64));
+    send_request(s, REQ_OTHER, 0, line);
+  } else if (r < 88) {
+    send_request(s, REQ_OTHER, 0,
+                 rnd(2) ? "bgstart all\n" : "bgstop all\n");
+  } else if (r < 93) {
+    snprintf(line, sizeof(line), "pstat %d\n", pid);
+    send_request(s, REQ_TRACKED, pid, line);
+  } else if (r < 97) {
+    send_request(s, REQ_OTHER, 0, "bglist --json -n 1\n");
+  } else if (r < 99) {
+    send_input(s, "bgn 4 true\n");
+  } else {
+    send_input(s, rnd(2) ? "bgstart all\n" : "bglist\n");
+  }
+}
+
+/* handles one reply, the reply to the oldest pending request */
+static void handle_reply(stress_t *s, char *reply) {
+  if (s->pending == 0) {
+    fprintf(stderr, "stress: reply without a request: %s\n", reply);
+    s->unexpected++;
+    return;
+  }
+  request *req = &s->window[s->first];
+  s->first = (s->first + 1) % WINDOW;
+  s->pending--;
+  s->ops++;
+  samples_add(&s->latency, bench_ns() - req->sent_ns);
+  snprintf(s->last, sizeof(s->last), "%.4000s", reply);
+  int ok = strncmp(reply, "{\"ok\": true", 11) == 0;
+  char *pid = strstr(reply, "\"pid\": ");
+  if (req->type == REQ_BG_SHORT || req->type == REQ_BG_LONG) {
+    s->started += ok;
+    // fork can fail legitimately this close to the process limits
+    s->bg_failed += !ok;
+    if (ok && req->type == REQ_BG_LONG && pid != NULL)
+      track(s, atoi(pid + 7));
+  } else if (req->type == REQ_TRACKED && !ok) {
+    fprintf(stderr, "stress: request for running process %d failed: %s\n",
+            req->pid, reply);
+    s->unexpected++;
+  }
+}
+
+/* reads what replies are available and handles the complete ones.
+ * returns: 0 on success, -1 if PMan closed the socket
+ */
+static int read_replies(stress_t *s) {
+  int n = read(s->sock, s->in + s->in_len, sizeof(s->in) - s->in_len - 1);
+  if (n == -1 && (errno == EAGAIN || errno == EINTR))
+    return 0;
+  if (n <= 0)
+    return -1;
+  s->in_len += n;
+  s->in[s->in_len] = '\0';
+  char *line = s->in, *end;
+  while ((end = strchr(line, '\n')) != NULL) {
+    *end = '\0';
+    handle_reply(s, line);
+    line = end + 1;
+  }
+  s->in_len -= line - s->in;
+  memmove(s->in, line, s->in_len + 1);
+  return 0;
+}
+
+/* waits up to ms for replies, and handles them.
+ * returns: 0 on success, -1 if PMan closed the socket
+ */
+static int wait_replies(stress_t *s, int ms) {
+  struct pollfd pfd = {s->sock, POLLIN, 0};
+  if (poll(&pfd, 1, ms) <= 0)
+    return 0;
+  return read_replies(s);
+}
+
+/* sends one request and waits for its reply.
+ * returns: the reply, valid until the next one, NULL if there was none
+ */
+static char *ask(stress_t *s, const char *line) {
+  send_request(s, REQ_OTHER, 0, line);
+  long long deadline = bench_ns() + 5000000000LL;
+  while (s->pending > 0 && bench_ns() < deadline) {
+    if (wait_replies(s, 1000) == -1)
+      return NULL;
+  }
+  return s->pending == 0 ? s->last : NULL;
+}
+
+/* Scans /proc for the children of parent.
+ * inputs: zombies - 1 to collect the pids of the zombies, 0 for the others
+ *         pids - filled with at most max pids
+ *         n - set to the number of pids collected
+ * returns: the number of children that aren't zombies
+ */
+static int scan_children(pid_t parent, int zombies, pid_t *pids, int *n,
+                         int max) {
+  DIR *proc = opendir("/proc");
+  if (proc == NULL)
+    return 0;
+  int alive = 0;
+  *n = 0;
+  struct dirent *entry;
+  char path[64], buf[512];
+  while ((entry = readdir(proc)) != NULL) {
+    if (entry->d_name[0] < '0' || entry->d_name[0] > '9')
+      continue;
+    snprintf(path, sizeof(path), "/proc/%.32s/stat", entry->d_name);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+      continue;
+    int len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0)
+      continue;
+    buf[len] = '\0';
+    // the command name can contain anything, the fields follow its ')'
+    char *fields = strrchr(buf, ')'), state;
+    int ppid;
+    if (fields == NULL || sscanf(fields + 1, " %c %d", &state, &ppid) != 2 ||
+        ppid != parent)
+      continue;
+    alive += state != 'Z';
+    if ((state == 'Z') == zombies && *n < max)
+      pids[(*n)++] = atoi(entry->d_name);
+  }
+  closedir(proc);
+  return alive;
+}
+
+/* Scans PMan's children, counting zombies that were already zombies in the
+ * previous scan, a second earlier, as left unreaped.
+ */
+static void check_zombies(stress_t *s) {
+  pid_t found[4096];
+  int n;
+  int alive = scan_children(s->pman, 1, found, &n, 4096);
+  if (alive > s->peak)
+    s->peak = alive;
+  for (int i = 0; i < n; i++) {
+    for (int j = 0; j < s->n_zombies; j++) {
+      if (found[i] == s->zombies[j]) {
+        fprintf(stderr, "stress: process %d was left unreaped\n", found[i]);
+        s->unreaped++;
+      }
+    }
+  }
+  s->zombies = realloc(s->zombies, (n + 1) * sizeof(pid_t));
+  if (s->zombies == NULL) {
+    fprintf(stderr, "Error: realloc failed in check_zombies");
+    exit(1);
+  }
+  memcpy(s->zombies, found, n * sizeof(pid_t));
+  s->n_zombies = n;
+}
+
+/* starts PMan with its stdin on a pipe, stdout discarded and stderr in
+ * err_path, and connects to its control socket
+ */
+static void start_pman(stress_t *s, char *pman, char *sock_path,
+                       char *err_path) {
+  int pipefd[2];
+  if (pipe2(pipefd, O_CLOEXEC) == -1) {
+    perror("pipe");
+    exit(1);
+  }
+  setenv("PMAN_SOCKET", sock_path, 1);
+  setenv("PMAN_CHECK", "1", 1);
+  setenv("PMAN_JOBTABLE", "", 1);
+  setenv("PMAN_KILL_GRACE", "200", 1);
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, pipefd[0], STDIN_FILENO);
+  posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null",
+                                   O_WRONLY, 0);
+  posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, err_path,
+                                   O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  char *args[] = {pman, NULL};
+  if (posix_spawn(&s->pman, pman, &actions, NULL, args, environ) != 0) {
+    fprintf(stderr, "stress: couldn't run %s\n", pman);
+    exit(1);
+  }
+  posix_spawn_file_actions_destroy(&actions);
+  close(pipefd[0]);
+  s->input = pipefd[1];
+  fcntl(s->input, F_SETFL, O_NONBLOCK);
+
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", sock_path);
+  s->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  for (int tries = 0; tries < 500; tries++) {
+    if (connect(s->sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+      fcntl(s->sock, F_SETFL, O_NONBLOCK);
+      return;
+    }
+    usleep(10000);
+  }
+  fprintf(stderr, "stress: couldn't connect to %s\n", sock_path);
+  kill(s->pman, SIGKILL);
+  exit(1);
+}
+
+/* waits for PMan to exit, killing it if it takes longer than timeout.
+ * returns: its wait status
+ */
+static int wait_pman(pid_t pman, int timeout_ms) {
+  int status;
+  long long deadline = bench_ns() + timeout_ms * 1000000LL;
+  while (waitpid(pman, &status, WNOHANG) == 0) {
+    if (bench_ns() > deadline) {
+      fprintf(stderr, "stress: PMan didn't exit, killing it\n");
+      kill(pman, SIGKILL);
+      waitpid(pman, &status, 0);
+      break;
+    }
+    usleep(10000);
+  }
+  return status;
+}
+
+/* prints the file PMan's stderr went to, if it isn't empty */
+static void print_errors(char *err_path) {
+  FILE *err = fopen(err_path, "r");
+  char line[1024];
+  while (err != NULL && fgets(line, sizeof(line), err) != NULL)
+    fputs(line, stderr);
+  if (err != NULL)
+    fclose(err);
+}
+
+int main(int argc, char *argv[]) {
+  char *pman = argc > 1 ? argv[1] : "./pman";
+  int seconds = argc > 2 ? atoi(argv[2]) : 10;
+  int children = argc > 3 ? atoi(argv[3]) : 2000;
+  if (seconds <= 0 || children <= 0) {
+    fprintf(stderr, "Usage: %s [pman] [seconds] [children]\n", argv[0]);
+    exit(1);
+  }
+  srand(time(NULL) ^ getpid());
+  // whatever PMan leaves running is reparented here once it exits
+  prctl(PR_SET_CHILD_SUBREAPER, 1);
+  signal(SIGPIPE, SIG_IGN);
+
+  char sock_path[64], err_path[64];
+  snprintf(sock_path, sizeof(sock_path), "/tmp/pman-stress-%d.sock",
+           getpid());
+  snprintf(err_path, sizeof(err_path), "/tmp/pman-stress-%d.err", getpid());
+  stress_t s = {0};
+  samples_init(&s.latency);
+  start_pman(&s, pman, sock_path, err_path);
+
+  int failed = 0, lost = 0;
+  long long start = bench_ns(), end = start + seconds * 1000000000LL;
+  long long next_scan = start + SCAN_MS * 1000000LL;
+  while (bench_ns() < end) {
+    while (s.pending < WINDOW)
+      random_op(&s, children);
+    if (wait_replies(&s, 1000) == -1) {
+      lost = 1;
+      break;
+    }
+    if (bench_ns() >= next_scan) {
+      check_zombies(&s);
+      next_scan += SCAN_MS * 1000000LL;
+    }
+  }
+  double elapsed = (bench_ns() - start) / 1e9;
+  while (!lost && s.pending > 0)
+    lost = wait_replies(&s, 1000) == -1;
+
+  // once the short lived children are done, PMan's list has to hold just
+  // the tracked ones
+  int total = -1;
+  if (!lost) {
+    send_input(&s, "bgstart all\n");
+    sleep(2);
+    check_zombies(&s);
+    char *reply = ask(&s, "bglist --json -n 1\n");
+    char *field = reply != NULL ? strstr(reply, "\"total\": ") : NULL;
+    total = field != NULL ? atoi(field + 9) : -1;
+    if (total != s.n_tracked) {
+      fprintf(stderr, "stress: PMan lists %d processes, %d are running\n",
+              total, s.n_tracked);
+      failed = 1;
+    }
+  }
+
+  if (write(s.input, "quit\n", 5) == -1 && !lost)
+    perror("stress: quit");
+  close(s.input);
+  close(s.sock);
+  int status = wait_pman(s.pman, EXIT_TIMEOUT_MS);
+  int exit_ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  if (lost || !exit_ok) {
+    fprintf(stderr, "stress: PMan %s, exit status %d%s\n",
+            lost ? "closed the control socket" : "failed",
+            WIFEXITED(status) ? WEXITSTATUS(status) : -1,
+            WIFSIGNALED(status) ? " (killed by a signal)" : "");
+    print_errors(err_path);
+    failed = 1;
+  }
+  // everything PMan started should have been killed on quit
+  usleep(200000);
+  pid_t left[4096];
+  int n_left, leftover = scan_children(getpid(), 0, left, &n_left, 4096);
+  if (leftover > 0) {
+    fprintf(stderr, "stress: %d processes PMan started are still running\n",
+            leftover);
+    failed = 1;
+    for (int i = 0; i < n_left; i++)
+      kill(left[i], SIGKILL);
+  }
+  while (waitpid(-1, NULL, WNOHANG) > 0)
+    ;
+  failed |= s.unexpected > 0 || s.unreaped > 0;
+
+  bench_report("stress.request", s.started, &s.latency);
+  printf("{\"bench\": \"stress\", \"seconds\": %.1f, \"ops\": %ld, "
+         "\"ops_per_s\": %.0f, \"started\": %ld, \"bg_failed\": %ld, "
+         "\"peak_children\": %d, \"listed\": %d, \"tracked\": %d, "
+         "\"unexpected\": %ld, \"unreaped\": %ld, \"leftover\": %d, "
+         "\"ok\": %s}\n",
+         elapsed, s.ops, s.ops / elapsed, s.started, s.bg_failed, s.peak,
+         total, s.n_tracked, s.unexpected, s.unreaped, leftover,
+         failed ? "false" : "true");
+  unlink(err_path);
+  samples_free(&s.latency);
+  free(s.tracked);
+  free(s.zombies);
+  return failed;
+}
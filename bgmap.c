@@ -0,0 +1,406 @@
+/* @file bgmap.c
+ * @brief Source file for bgmap, which runs a command template once per
+ * line of an input file, at most 'jobs' instances at a time. The input is
+ * read as instances are needed rather than all at once, so it can be a
+ * huge file or a pipe that is still being written to. Finished instances
+ * are replaced as soon as they are reaped, and instead of an exit message
+ * per instance, every map reports its progress and failures as one line.
+ */
+
+#include "bgmap.h"
+#include "admission.h"
+#include "event.h"
+#include "jobqueue.h"
+#include "process.h"
+#include "reader.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// the argument of the template every input line is substituted for
+#define SLOT "{}"
+// max arguments of a template, same as commands typed into PMan
+#define MAP_MAX_ARGS 100
+// how often maps held by admission control are retried, in ms
+#define RECHECK_MS 500
+
+typedef struct map_t {
+  struct map_t *next;
+  int id;
+  // the command template, and whether any argument of it has a slot. If
+  // none does, the input line is added as the last argument.
+  char *tmpl[MAP_MAX_ARGS];
+  int n_args;
+  int has_slot;
+  char name[LINE_MAX];
+  // max instances running at once
+  int jobs;
+  int running;
+  long read;
+  long done;
+  long failed;
+  linereader_t input;
+  // 1 while the input is a pipe that had nothing to read, and is watched
+  // by the event loop
+  int watching;
+  // 1 once no more instances are started, after the input ended, bgmap -c
+  // or an instance that couldn't be started
+  int stopped;
+  // 1 if the progress changed since it was last reported
+  int changed;
+  long long start_ns;
+  // failures that haven't been reported yet
+  strbuf_t failures;
+
+} map_t;
+
+static map_t *maps = NULL;
+static int next_id = 1;
+// timer retrying maps held by admission control, -1 when none are
+static int recheck_fd = -1;
+
+/* returns the map with an id, NULL if there is none */
+static map_t *find_map(int id) {
+  map_t *map = maps;
+  while (map != NULL && map->id != id)
+    map = map->next;
+  return map;
+}
+
+/* frees a map, closing its input */
+static void free_map(map_t *map) {
+  if (map->watching)
+    ev_del(map->input.fd);
+  close(map->input.fd);
+  lr_free(&map->input);
+  for (int i = 0; i < map->n_args; i++)
+    free(map->tmpl[i]);
+  sb_free(&map->failures);
+  free(map);
+}
+
+/* event handler for the input of a map once a pipe has more of it */
+static int input_ready(int fd, uint32_t events, void *data) {
+  for (map_t *map = maps; map != NULL; map = map->next) {
+    if (map->input.fd == fd && map->watching) {
+      ev_del(fd);
+      map->watching = 0;
+    }
+  }
+  return map_run(data);
+}
+
+/* timer handler retrying maps while admission control holds them */
+static int recheck(int fd, uint32_t events, void *data) {
+  return map_run(data);
+}
+
+/* Returns the next line of input of a map, reading more of it if needed.
+ * returns: the line, valid until the next call, or NULL if there is none
+ *          right now (see map->input.eof and map->watching)
+ */
+static char *next_input(map_t *map, plist_t *processes) {
+  char *line;
+  while ((line = lr_next(&map->input)) == NULL && !map->input.eof) {
+    int n = lr_fill(&map->input);
+    if (n == -1 && errno == EAGAIN) {
+      // a pipe with nothing in it yet, wait for the event loop
+      if (ev_add(map->input.fd, EPOLLIN, input_ready, processes) == 0)
+        map->watching = 1;
+      return NULL;
+    }
+    if (n == -1) {
+      sb_printf(&map->failures, "%s  - bgmap %d: Failed to read input: %s",
+                map->failures.len ? "\n" : "", map->id, strerror(errno));
+      map->input.eof = 1;
+    }
+  }
+  return line;
+}
+
+/* starts one instance of a map for an input line. Instances whose
+ * command line would be LINE_MAX or longer, like commands typed into PMan,
+ * aren't started.
+ * returns: 0 on success, -1 if it couldn't be started, 1 if it was too long
+ */
+static int start_instance(map_t *map, char *line, plist_t *processes) {
+  char *args[MAP_MAX_ARGS + 1];
+  int n = 0;
+  for (int i = 0; i < map->n_args; i++) {
+    char *slot = strstr(map->tmpl[i], SLOT);
+    if (slot == NULL) {
+      args[n++] = map->tmpl[i];
+      continue;
+    }
+    // every slot in the argument is replaced with the line
+    strbuf_t arg;
+    sb_init(&arg);
+    for (char *rest = map->tmpl[i]; rest != NULL;) {
+      slot = strstr(rest, SLOT);
+      if (slot == NULL) {
+        sb_printf(&arg, "%s", rest);
+        break;
+      }
+      sb_printf(&arg, "%.*s%s", (int)(slot - rest), rest, line);
+      rest = slot + strlen(SLOT);
+    }
+    args[n++] = arg.data;
+  }
+  if (!map->has_slot)
+    args[n++] = line;
+  args[n] = NULL;
+  size_t len = 0;
+  for (int i = 0; i < n; i++)
+    len += strlen(args[i]) + 1;
+
+  int pid = len >= LINE_MAX ? 0 : fork_process(args, processes, BG);
+  for (int i = 0; i < map->n_args; i++) {
+    if (args[i] != map->tmpl[i])
+      free(args[i]);
+  }
+  if (pid == 0)
+    return 1;
+  if (pid == -1)
+    return -1;
+  get_process(processes, pid)->map = map->id;
+  map->running++;
+  return 0;
+}
+
+/* Starts instances of a map until 'jobs' are running, its input has
+ * nothing more right now or admission control holds new processes.
+ * returns: 1 if admission control held it, 0 otherwise
+ */
+static int fill(map_t *map, plist_t *processes) {
+  while (!map->stopped && map->running < map->jobs) {
+    if (admit_check() != NULL)
+      return 1;
+    char *line = next_input(map, processes);
+    if (line == NULL) {
+      if (map->input.eof)
+        map->stopped = 1;
+      break;
+    }
+    if (all_spaces(line))
+      continue;
+    map->read++;
+    map->changed = 1;
+    int started = start_instance(map, line, processes);
+    if (started == 1) {
+      map->done++;
+      map->failed++;
+      sb_printf(&map->failures,
+                "%s  - bgmap %d: Skipped instance %ld, its command would be "
+                "longer than %d characters",
+                map->failures.len ? "\n" : "", map->id, map->read,
+                LINE_MAX - 1);
+    } else if (started == -1) {
+      // the rest would most likely fail the same way
+      map->failed++;
+      map->stopped = 1;
+      sb_printf(&map->failures,
+                "%s  - bgmap %d: Stopped after an instance failed to start",
+                map->failures.len ? "\n" : "", map->id);
+    }
+  }
+  return 0;
+}
+
+/* adds a line with the progress of a map to out */
+static void progress(map_t *map, strbuf_t *out) {
+  if (map->failures.len > 0) {
+    sb_printf(out, "%s%s", out->len ? "\n" : "", map->failures.data);
+    map->failures.len = 0;
+  }
+  sb_printf(out, "%s  - bgmap %d: %ld", out->len ? "\n" : "", map->id,
+            map->done);
+  // the total is only known once the input ended
+  if (map->stopped)
+    sb_printf(out, "/%ld", map->read);
+  sb_printf(out, " done, %ld failed, %d running", map->failed, map->running);
+  if (map->stopped && map->running == 0)
+    sb_printf(out, ", finished in %.1fs",
+              (monotonic_ns() - map->start_ns) / 1e9);
+  map->changed = 0;
+}
+
+/* Starts instances of every map to replace the ones that finished, and
+ * reports the progress of the maps that changed as one block. Maps that
+ * are done are freed.
+ * inputs: processes - list of background processes
+ * returns: 1 if progress was printed, 0 otherwise
+ */
+int map_run(plist_t *processes) {
+  int held = 0;
+  strbuf_t out;
+  sb_init(&out);
+  map_t **link = &maps;
+  while (*link != NULL) {
+    map_t *map = *link;
+    held |= fill(map, processes);
+    if (map->changed || map->failures.len > 0)
+      progress(map, &out);
+    if (map->stopped && map->running == 0) {
+      *link = map->next;
+      free_map(map);
+    } else {
+      link = &map->next;
+    }
+  }
+  if (held && recheck_fd == -1) {
+    recheck_fd = ev_timer(RECHECK_MS, recheck, processes);
+  } else if (!held && recheck_fd != -1) {
+    ev_timer_stop(recheck_fd);
+    recheck_fd = -1;
+  }
+  if (out.len > 0)
+    msg_on_prev_line(out.data);
+  int printed = out.len > 0;
+  sb_free(&out);
+  return printed;
+}
+
+/* Starts a map: bgmap [-j jobs] template... < file. Prints an error if
+ * the arguments are invalid.
+ * inputs: args - the arguments of bgmap
+ *         processes - list of background processes
+ * returns: the id of the map, -1 if it wasn't started
+ */
+int map_start(char *args[], plist_t *processes) {
+  int jobs = get_max_running(), i = 0;
+  if (args[i] != NULL && strcmp(args[i], "-j") == 0) {
+    if (args[i + 1] == NULL || atoi(args[i + 1]) <= 0) {
+      printf("Error: Expected max running instances after -j\n");
+      return -1;
+    }
+    jobs = atoi(args[i + 1]);
+    i += 2;
+  }
+  int first = i;
+  while (args[i] != NULL && strcmp(args[i], "<") != 0)
+    i++;
+  if (i == first) {
+    printf("Error: Expected a command template\n");
+    return -1;
+  }
+  if (args[i] == NULL || args[i + 1] == NULL || args[i + 2] != NULL) {
+    printf("Error: Expected \"< file\" after the command template\n");
+    return -1;
+  }
+  if (i - first > MAP_MAX_ARGS - 1) {
+    printf("Error: Too many arguments\n");
+    return -1;
+  }
+  // non blocking, so a pipe with nothing in it doesn't stall PMan
+  int fd = open(args[i + 1], O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  if (fd == -1) {
+    perror(args[i + 1]);
+    return -1;
+  }
+
+  map_t *map = calloc(1, sizeof(map_t));
+  if (map == NULL) {
+    fprintf(stderr, "Error: calloc failed in map_start");
+    exit(1);
+  }
+  map->id = next_id++;
+  map->jobs = jobs;
+  for (int j = first; j < i; j++) {
+    map->tmpl[map->n_args] = strdup(args[j]);
+    if (map->tmpl[map->n_args] == NULL) {
+      fprintf(stderr, "Error: strdup failed in map_start");
+      exit(1);
+    }
+    map->has_slot |= strstr(args[j], SLOT) != NULL;
+    map->n_args++;
+  }
+  map->tmpl[map->n_args] = NULL;
+  concat_strs(map->name, map->tmpl, LINE_MAX);
+  lr_init(&map->input, fd);
+  sb_init(&map->failures);
+  map->start_ns = monotonic_ns();
+  // new maps go last, so progress is reported in the order they started
+  map_t **link = &maps;
+  while (*link != NULL)
+    link = &(*link)->next;
+  *link = map;
+  printf("Started bgmap %d of \"%s\", at most %d running\n", map->id,
+         map->name, jobs);
+  map_run(processes);
+  return map->id;
+}
+
+/* Records that an instance of a map is done, called as it's removed from
+ * the process list. The map starts its replacement in map_run.
+ * inputs: process - the instance
+ *         status - its wait status, -1 if it isn't known
+ */
+void map_job_done(process_t *process, int status) {
+  map_t *map = find_map(process->map);
+  if (map == NULL)
+    return;
+  map->running--;
+  map->done++;
+  map->changed = 1;
+  if (status == -1 || WIFSIGNALED(status) || WEXITSTATUS(status) != 0) {
+    char how[32];
+    if (status == -1)
+      snprintf(how, sizeof(how), "with an unknown status");
+    else if (WIFSIGNALED(status))
+      snprintf(how, sizeof(how), "by signal %d", WTERMSIG(status));
+    else
+      snprintf(how, sizeof(how), "with exit %d", WEXITSTATUS(status));
+    map->failed++;
+    sb_printf(&map->failures, "%s  - bgmap %d: Process %d \"%s\" failed %s",
+              map->failures.len ? "\n" : "", map->id, process->pid,
+              process->name, how);
+  }
+}
+
+/* Stops a map from starting more instances, the running ones finish.
+ * returns: 0 on success, -1 if there is no map with that id
+ */
+int map_cancel(int id) {
+  map_t *map = find_map(id);
+  if (map == NULL)
+    return -1;
+  map->stopped = 1;
+  map->changed = 1;
+  return 0;
+}
+
+/* prints the progress of every map */
+void list_maps() {
+  if (maps == NULL) {
+    printf("No bgmaps running\n");
+    return;
+  }
+  for (map_t *map = maps; map != NULL; map = map->next) {
+    printf("bgmap %d: \"%s\", %ld read, %ld done, %ld failed, %d of at most "
+           "%d running%s\n",
+           map->id, map->name, map->read, map->done, map->failed,
+           map->running, map->jobs,
+           map->stopped ? ", finishing" : "");
+  }
+}
+
+/* returns 1 while any map has instances running or input left */
+int maps_active() { return maps != NULL; }
+
+/* frees every map */
+void free_maps() {
+  while (maps != NULL) {
+    map_t *next = maps->next;
+    free_map(maps);
+    maps = next;
+  }
+  if (recheck_fd != -1)
+    ev_timer_stop(recheck_fd);
+  recheck_fd = -1;
+}
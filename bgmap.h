@@ -0,0 +1,18 @@
+/* @file bgmap.h
+ * @brief Header file for bgmap, running a command template over an input
+ */
+
+#include "list.h"
+
+#ifndef _BGMAP_H_
+#define _BGMAP_H_
+
+int map_start(char *args[], plist_t *processes);
+int map_run(plist_t *processes);
+void map_job_done(process_t *process, int status);
+int map_cancel(int id);
+void list_maps();
+int maps_active();
+void free_maps();
+
+#endif
@@ -0,0 +1,314 @@
+/* @file capture.c
+ * @brief Source file for capturing the output of background processes.
+ * Every background process writes its stdout and stderr into its own pipe,
+ * and PMan moves the data from the pipe into a per process log file with
+ * splice(), so the bytes never pass through PMan's memory and never
+ * interleave with the prompt. bglog copies a log to the terminal with
+ * sendfile(), optionally following it as more output arrives.
+ */
+
+#define _GNU_SOURCE
+#include "capture.h"
+#include "event.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// max bytes moved by one splice call
+#define SPLICE_LEN (1 << 16)
+
+// a background process whose output is being captured
+typedef struct capture_t {
+  pid_t pid;
+  int pipe_fd;
+  int log_fd;
+  // name the log was created with in log_dir, until it's renamed to
+  // (pid).log once the process is started
+  char tmp_name[32];
+  struct capture_t *next;
+  struct capture_t *prev;
+
+} capture_t;
+
+// captures still receiving output
+static capture_t *captures = NULL;
+
+static char log_dir[PATH_MAX] = "";
+// logs in a directory PMan created itself are removed on exit
+static int own_dir = 0;
+// process whose log bglog -f is following, and how much of it was printed
+static pid_t follow_pid = -1;
+static off_t follow_offset = 0;
+
+/* returns 1 if output capture is enabled, it can be disabled by setting
+ * the environment variable PMAN_CAPTURE=0.
+ */
+int capture_enabled() {
+  static int enabled = -1;
+  if (enabled == -1) {
+    char *env = getenv("PMAN_CAPTURE");
+    enabled = env == NULL || strcmp(env, "0") != 0;
+  }
+  return enabled;
+}
+
+/* Creates the log directory on first use: $PMAN_LOG_DIR, or a new private
+ * directory in $TMPDIR (/tmp) made with mkdtemp, so no other user can have
+ * created it or put anything in it beforehand.
+ * returns: 0 on success, -1 if the directory can't be created
+ */
+static int open_log_dir() {
+  if (log_dir[0] != '\0')
+    return 0;
+  char *dir = getenv("PMAN_LOG_DIR");
+  if (dir != NULL) {
+    snprintf(log_dir, sizeof(log_dir), "%s", dir);
+    if (mkdir(log_dir, 0700) == -1 && errno != EEXIST) {
+      log_dir[0] = '\0';
+      return -1;
+    }
+    return 0;
+  }
+  char *tmp = getenv("TMPDIR");
+  snprintf(log_dir, sizeof(log_dir), "%s/pman-XXXXXX", tmp ? tmp : "/tmp");
+  if (mkdtemp(log_dir) == NULL) {
+    log_dir[0] = '\0';
+    return -1;
+  }
+  own_dir = 1;
+  return 0;
+}
+
+/* builds the path of the log of a process */
+static void log_path(pid_t pid, char *path, int size) {
+  snprintf(path, size, "%s/%d.log", log_dir, pid);
+}
+
+/* finds the capture reading from pipe_fd */
+static capture_t *find_capture(int pipe_fd) {
+  capture_t *cap = captures;
+  while (cap != NULL && cap->pipe_fd != pipe_fd)
+    cap = cap->next;
+  return cap;
+}
+
+/* stops a capture and frees it, closing its pipe and log */
+static void free_capture(capture_t *cap) {
+  if (cap->prev != NULL)
+    cap->prev->next = cap->next;
+  else
+    captures = cap->next;
+  if (cap->next != NULL)
+    cap->next->prev = cap->prev;
+  ev_del(cap->pipe_fd);
+  close(cap->pipe_fd);
+  close(cap->log_fd);
+  free(cap);
+}
+
+/* copies the log from follow_offset to the end onto stdout */
+static void follow_log(int log_fd) {
+  struct stat st;
+  if (fstat(log_fd, &st) == -1)
+    return;
+  while (follow_offset < st.st_size) {
+    if (sendfile(STDOUT_FILENO, log_fd, &follow_offset,
+                 st.st_size - follow_offset) <= 0)
+      break;
+  }
+}
+
+/* event handler for the output pipe of a background process. Splices
+ * everything in the pipe into the process' log. Once the process (and
+ * anything it started) closed the pipe, the capture is finished.
+ */
+static int drain(int fd, uint32_t events, void *data) {
+  capture_t *cap = data;
+  ssize_t n;
+  while ((n = splice(cap->pipe_fd, NULL, cap->log_fd, NULL, SPLICE_LEN,
+                     SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) > 0)
+    ;
+  int done = n == 0 || errno != EAGAIN;
+  int following = cap->pid == follow_pid;
+  if (following)
+    follow_log(cap->log_fd);
+  if (!done)
+    return 0;
+
+  // EOF, or the log can't be written to anymore
+  free_capture(cap);
+  if (following) {
+    stop_following();
+    return 1;
+  }
+  return 0;
+}
+
+/* Sets up the capture of a new background process before it's started:
+ * creates its log under a temporary name (with O_EXCL, so an existing file
+ * or symlink is never opened), and the pipe it writes its output into,
+ * which is watched right away. Nothing can fail after the process is
+ * started, so it never loses the reader of its output.
+ * inputs: child_fd - set to the write end, which becomes the child's stdout
+ *                    and stderr. The parent must close it after spawning.
+ * returns: the read end of the pipe, to pass to capture_attach or
+ *          capture_cancel, -1 if the output can't be captured (the child
+ *          then keeps PMan's stdout and stderr)
+ */
+int capture_open(int *child_fd) {
+  capture_t *cap = malloc(sizeof(capture_t));
+  if (cap == NULL) {
+    fprintf(stderr, "Error: malloc failed in capture_open");
+    exit(1);
+  }
+  char path[PATH_MAX];
+  if (open_log_dir() == -1) {
+    free(cap);
+    return -1;
+  }
+  if (snprintf(path, sizeof(path), "%s/new-XXXXXX", log_dir) >=
+      (int)sizeof(path)) {
+    free(cap);
+    return -1;
+  }
+  // log_fd is also read from, to send new output to bglog -f.
+  // it can't be O_APPEND, splice() refuses to write to such files.
+  cap->log_fd = mkostemp(path, O_CLOEXEC);
+  if (cap->log_fd == -1) {
+    free(cap);
+    return -1;
+  }
+  snprintf(cap->tmp_name, sizeof(cap->tmp_name), "%s",
+           strrchr(path, '/') + 1);
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) == -1) {
+    unlink(path);
+    close(cap->log_fd);
+    free(cap);
+    return -1;
+  }
+  // only PMan's end is non blocking, the child writes normally.
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  if (ev_add(fds[0], EPOLLIN, drain, cap) == -1) {
+    unlink(path);
+    close(fds[0]);
+    close(fds[1]);
+    close(cap->log_fd);
+    free(cap);
+    return -1;
+  }
+  cap->pid = 0;
+  cap->pipe_fd = fds[0];
+  cap->prev = NULL;
+  cap->next = captures;
+  if (captures != NULL)
+    captures->prev = cap;
+  captures = cap;
+  *child_fd = fds[1];
+  return fds[0];
+}
+
+/* Names the capture set up by capture_open after the process that was
+ * started with it, so bglog finds its log.
+ * returns: 0 on success, -1 if the log couldn't be renamed (the output is
+ *          still captured)
+ */
+int capture_attach(int pipe_fd, pid_t pid) {
+  capture_t *cap = find_capture(pipe_fd);
+  if (cap == NULL)
+    return -1;
+  cap->pid = pid;
+  char name[32];
+  snprintf(name, sizeof(name), "%d.log", pid);
+  // replaces a log left by an earlier process with the same pid
+  int dir = open(log_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  int result = dir == -1 ? -1 : renameat(dir, cap->tmp_name, dir, name);
+  if (dir != -1)
+    close(dir);
+  return result;
+}
+
+/* Moves the log of a process to another pid, for a pipeline that is now
+ * listed under a later stage (see rekey_node), so bglog finds it by the pid
+ * bglist shows.
+ */
+void capture_rekey(pid_t old_pid, pid_t new_pid) {
+  if (log_dir[0] == '\0')
+    return;
+  for (capture_t *cap = captures; cap != NULL; cap = cap->next) {
+    if (cap->pid == old_pid)
+      cap->pid = new_pid;
+  }
+  if (follow_pid == old_pid)
+    follow_pid = new_pid;
+  char from[PATH_MAX], to[PATH_MAX];
+  log_path(old_pid, from, sizeof(from));
+  log_path(new_pid, to, sizeof(to));
+  rename(from, to);
+}
+
+/* undoes capture_open after the process couldn't be started */
+void capture_cancel(int pipe_fd) {
+  capture_t *cap = find_capture(pipe_fd);
+  if (cap == NULL)
+    return;
+  char path[PATH_MAX];
+  if (snprintf(path, sizeof(path), "%s/%s", log_dir, cap->tmp_name) <
+      (int)sizeof(path))
+    unlink(path);
+  free_capture(cap);
+}
+
+/* Prints the captured output of a process. With follow, keeps printing
+ * output as it arrives until the process closes its output or
+ * stop_following is called. Following a process that already closed its
+ * output just prints the log.
+ * returns: 0 on success, -1 if there is no log for the process
+ */
+int print_log(pid_t pid, int follow) {
+  char path[PATH_MAX];
+  if (log_dir[0] == '\0')
+    return -1;
+  log_path(pid, path, sizeof(path));
+  int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd == -1)
+    return -1;
+  fflush(stdout);
+  follow_offset = 0;
+  follow_log(fd);
+  close(fd);
+  for (capture_t *cap = captures; follow && cap != NULL; cap = cap->next) {
+    if (cap->pid == pid)
+      follow_pid = pid;
+  }
+  return 0;
+}
+
+/* returns 1 if bglog -f is following a log, 0 otherwise */
+int log_following() { return follow_pid != -1; }
+
+/* stops following a log */
+void stop_following() { follow_pid = -1; }
+
+/* removes the log directory and the logs in it if PMan created it */
+void capture_cleanup() {
+  if (!own_dir || log_dir[0] == '\0')
+    return;
+  DIR *dir = opendir(log_dir);
+  if (dir == NULL)
+    return;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] != '.')
+      unlinkat(dirfd(dir), entry->d_name, 0);
+  }
+  closedir(dir);
+  rmdir(log_dir);
+}
@@ -0,0 +1,20 @@
+/* @file capture.h
+ * @brief Header file for capturing the output of background processes
+ */
+
+#include <sys/types.h>
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+int capture_enabled();
+int capture_open(int *child_fd);
+int capture_attach(int pipe_fd, pid_t pid);
+void capture_cancel(int pipe_fd);
+void capture_rekey(pid_t old_pid, pid_t new_pid);
+int print_log(pid_t pid, int follow);
+int log_following();
+void stop_following();
+void capture_cleanup();
+
+#endif
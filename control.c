@@ -0,0 +1,426 @@
+/* @file control.c
+ * @brief Source file for the unix socket control interface. Tools submit
+ * and manage background processes through a stream socket, one request per
+ * line, and get one JSON object per line back, in the order the requests
+ * were sent. The listening socket and every client are non blocking and
+ * multiplexed into the event loop, so any number of clients can send
+ * requests at once without holding up the prompt.
+ *
+ * Requests:              Replies:
+ *   bg args...             {"ok": true, "pid": N}, or {"ok": true,
+ *                          "queued": N, "held": "reason"} if admission
+ *                          control holds it in the bgqueue
+ *   bglist [options]       {"ok": true, "total": N, "page": N,
+ *                           "processes": [{"pid": N, ...}, ...],
+ *                           "queued": N, "held": "reason" or null}, takes
+ *                          the options of bglist
+ *   bghist [options]       {"ok": true, "total": N, "completed": N,
+ *                           "history": [{"pid": N, ...}, ...]}, takes the
+ *                          options of bghist
+ *   bgkill pid             {"ok": true, "pid": N}
+ *   bgstop pid             {"ok": true, "pid": N}
+ *   bgstart pid            {"ok": true, "pid": N}
+ *   bgkill first-last|all  {"ok": true, "count": N}, and the same for
+ *                          bgstop and bgstart
+ *   pstat [pid]            {"ok": true, "pstat": [{"pid": N, ...}, ...]}
+ * Failed requests reply {"ok": false, "error": "message"}.
+ */
+
+#define _GNU_SOURCE
+#include "control.h"
+#include "admission.h"
+#include "event.h"
+#include "history.h"
+#include "jobqueue.h"
+#include "list.h"
+#include "process.h"
+#include "reader.h"
+#include "sampler.h"
+#include "utils.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// max arguments of a request
+#define CTL_ARGS 100
+// a client that doesn't read its replies is no longer read from once
+// this many bytes of replies are waiting for it
+#define MAX_PENDING (1 << 20)
+
+// a connected client, with its partly read requests and unsent replies
+typedef struct client_t {
+  int fd;
+  linereader_t in;
+  strbuf_t out;
+  size_t sent;
+  int closing;
+  uint32_t events;
+  struct client_t *next;
+  struct client_t *prev;
+
+} client_t;
+
+static int listen_fd = -1;
+static char *socket_path = NULL;
+static client_t *clients = NULL;
+static plist_t *procs = NULL;
+
+/* appends a failed reply to out */
+static void reply_error(strbuf_t *out, const char *msg) {
+  sb_printf(out, "{\"ok\": false, \"error\": ");
+  sb_json_str(out, msg);
+  sb_printf(out, "}\n");
+}
+
+/* parses the pid argument of a request, returns -1 if it isn't one */
+static int request_pid(char *args[]) {
+  if (args[1] == NULL || args[2] != NULL)
+    return -1;
+  char *end;
+  long pid = strtol(args[1], &end, 10);
+  return *end != '\0' || pid <= 0 ? -1 : pid;
+}
+
+/* replies with the background processes, filtered, sorted and paged by
+ * the same options as bglist (see parse_list_opts)
+ */
+static void reply_list(strbuf_t *out, plist_t *processes, char *args[]) {
+  list_opts opts;
+  init_list_opts(&opts);
+  const char *error = parse_list_opts(args, &opts);
+  if (error != NULL) {
+    reply_error(out, error);
+    return;
+  }
+  sb_printf(out, "{\"ok\": true, ");
+  list_json(processes, &opts, out);
+  sb_printf(out, "}\n");
+}
+
+/* replies with the completed processes bghist would show */
+static void reply_hist(strbuf_t *out, char *args[]) {
+  hist_opts opts;
+  init_hist_opts(&opts);
+  const char *error = parse_hist_opts(args, &opts);
+  if (error != NULL) {
+    reply_error(out, error);
+    return;
+  }
+  sb_printf(out, "{\"ok\": true, ");
+  hist_json(&opts, out);
+  sb_printf(out, "}\n");
+}
+
+/* appends the /proc stats of a process as a JSON object to out */
+static void pstat_json(strbuf_t *out, int pid, pstat_t *st) {
+  sb_printf(out, "{\"pid\": %d, \"comm\": ", pid);
+  sb_json_str(out, st->comm);
+  sb_printf(out,
+            ", \"state\": \"%c\", \"utime\": %lu, \"stime\": %lu, "
+            "\"rss\": %ld, \"minflt\": %lu, \"majflt\": %lu, "
+            "\"nswitch\": %lu}",
+            st->state, st->utime, st->stime, st->rss, st->minflt, st->majflt,
+            st->nswitch);
+}
+
+/* replies with the stats of pid, or of every background process */
+static void reply_pstat(strbuf_t *out, plist_t *processes, int pid) {
+  pstat_t st;
+  if (pid != -1) {
+    if (read_pstat(pid, &st) == -1) {
+      reply_error(out, "Process does not exist");
+      return;
+    }
+    sb_printf(out, "{\"ok\": true, \"pstat\": [");
+    pstat_json(out, pid, &st);
+    sb_printf(out, "]}\n");
+    return;
+  }
+  sample_all(processes);
+  int first = 1;
+  sb_printf(out, "{\"ok\": true, \"pstat\": [");
+  for (process_t *cur = processes->head; cur != NULL; cur = cur->next) {
+    if (cur->stats == NULL || cur->stats->samples == 0)
+      continue;
+    sb_printf(out, first ? "" : ", ");
+    pstat_json(out, cur->pid, &cur->stats->cur);
+    first = 0;
+  }
+  sb_printf(out, "]}\n");
+}
+
+/* handles one request line, appending its reply to out */
+static void handle_request(char *line, strbuf_t *out, plist_t *processes) {
+  char *args[CTL_ARGS], *save;
+  int n = 0;
+  // same limit as commands typed into PMan, process names are built in
+  // LINE_MAX buffers
+  if (strlen(line) >= LINE_MAX) {
+    reply_error(out, "Request too long");
+    return;
+  }
+  char *tok = strtok_r(line, " \t", &save);
+  while (tok != NULL && n < CTL_ARGS - 1) {
+    args[n++] = tok;
+    tok = strtok_r(NULL, " \t", &save);
+  }
+  args[n] = NULL;
+  if (n == 0) {
+    reply_error(out, "Expected input");
+    return;
+  }
+
+  char *cmd = args[0];
+  int sig = -1;
+  if (strcmp(cmd, "bg") == 0) {
+    if (args[1] == NULL) {
+      reply_error(out, "Expected arguments");
+      return;
+    }
+    const char *held = admit_check();
+    if (held != NULL) {
+      queue_hold(&args[1]);
+      sb_printf(out, "{\"ok\": true, \"queued\": %d, \"held\": ",
+                queued_jobs()->size);
+      sb_json_str(out, held);
+      sb_printf(out, "}\n");
+      queue_run(processes);
+      return;
+    }
+    int err;
+    char *failed;
+    int pid = start_process(&args[1], processes, BG, &err, &failed);
+    if (pid == -1) {
+      reply_error(out, start_error(err));
+      return;
+    }
+    sb_printf(out, "{\"ok\": true, \"pid\": %d}\n", pid);
+    return;
+  } else if (strcmp(cmd, "bglist") == 0) {
+    reply_list(out, processes, &args[1]);
+    return;
+  } else if (strcmp(cmd, "bghist") == 0) {
+    reply_hist(out, &args[1]);
+    return;
+  } else if (strcmp(cmd, "pstat") == 0) {
+    int pid = args[1] == NULL ? -1 : request_pid(args);
+    if (args[1] != NULL && pid == -1)
+      reply_error(out, "Expected process id");
+    else
+      reply_pstat(out, processes, pid);
+    return;
+  } else if (strcmp(cmd, "bgkill") == 0) {
+    sig = SIGKILL;
+  } else if (strcmp(cmd, "bgstop") == 0) {
+    sig = SIGSTOP;
+  } else if (strcmp(cmd, "bgstart") == 0) {
+    sig = SIGCONT;
+  } else {
+    reply_error(out, "Unknown request");
+    return;
+  }
+
+  pid_t lo, hi;
+  if (args[1] == NULL || args[2] != NULL ||
+      parse_target(args[1], &lo, &hi) == -1)
+    reply_error(out, "Expected process id, range of process ids or all");
+  else if (lo != hi)
+    sb_printf(out, "{\"ok\": true, \"count\": %d}\n",
+              signal_range(processes, lo, hi, sig));
+  else if (signal_job(processes, lo, sig) == -1)
+    reply_error(out, "Process doesn't exist or was not started by PMan");
+  else
+    sb_printf(out, "{\"ok\": true, \"pid\": %d}\n", lo);
+}
+
+/* disconnects a client and frees it */
+static void drop_client(client_t *client) {
+  ev_del(client->fd);
+  close(client->fd);
+  lr_free(&client->in);
+  sb_free(&client->out);
+  if (client->prev != NULL)
+    client->prev->next = client->next;
+  else
+    clients = client->next;
+  if (client->next != NULL)
+    client->next->prev = client->prev;
+  free(client);
+}
+
+/* Sends as much of the client's pending replies as the socket takes, and
+ * watches for the socket becoming writable if some are left.
+ * returns: 0 on success, -1 if the client is gone
+ */
+static int flush_client(client_t *client) {
+  while (client->sent < client->out.len) {
+    ssize_t n = send(client->fd, client->out.data + client->sent,
+                     client->out.len - client->sent, MSG_NOSIGNAL);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN)
+        return -1;
+      break;
+    }
+    client->sent += n;
+  }
+  if (client->sent == client->out.len) {
+    client->sent = 0;
+    client->out.len = 0;
+  }
+  int pending = client->out.len > 0;
+  if (!pending && client->closing)
+    return -1;
+  // stop reading requests from a client that isn't reading its replies
+  uint32_t events = client->closing || client->out.len >= MAX_PENDING
+                        ? 0
+                        : EPOLLIN;
+  events |= pending ? EPOLLOUT : 0;
+  if (events == client->events)
+    return 0;
+  client->events = events;
+  return ev_mod(client->fd, events);
+}
+
+/* event handler for a client socket, handles every complete request that
+ * was read and sends the replies.
+ */
+static int client_ready(int fd, uint32_t events, void *data) {
+  client_t *client = data;
+  if (events & (EPOLLIN | EPOLLHUP | EPOLLERR) && !client->closing) {
+    int n = lr_fill(&client->in);
+    if (n == -1 && errno != EAGAIN) {
+      drop_client(client);
+      return 0;
+    }
+    char *line;
+    while ((line = lr_next(&client->in)) != NULL)
+      handle_request(line, &client->out, procs);
+    if (n == 0)
+      client->closing = 1;
+    // what is left is part of a request, which is never longer than
+    // LINE_MAX. A client that sends more without a newline is dropped
+    // once it got the error, rather than buffered without limit.
+    if (client->in.end - client->in.start >= LINE_MAX && !client->closing) {
+      reply_error(&client->out, "Request too long");
+      client->closing = 1;
+    }
+  }
+  if (flush_client(client) == -1)
+    drop_client(client);
+  return 0;
+}
+
+/* event handler for the listening socket, accepts every waiting client */
+static int accept_clients(int fd, uint32_t events, void *data) {
+  int client_fd;
+  while ((client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) !=
+         -1) {
+    client_t *client = malloc(sizeof(client_t));
+    if (client == NULL) {
+      fprintf(stderr, "Error: malloc failed in accept_clients");
+      exit(1);
+    }
+    client->fd = client_fd;
+    lr_init(&client->in, client_fd);
+    sb_init(&client->out);
+    client->sent = 0;
+    client->closing = 0;
+    client->events = EPOLLIN;
+    if (ev_add(client_fd, EPOLLIN, client_ready, client) == -1) {
+      close(client_fd);
+      lr_free(&client->in);
+      sb_free(&client->out);
+      free(client);
+      continue;
+    }
+    client->prev = NULL;
+    client->next = clients;
+    if (clients != NULL)
+      clients->prev = client;
+    clients = client;
+  }
+  return 0;
+}
+
+/* Removes a socket left at path by a PMan that is gone: one that is a
+ * socket nobody accepts connections on. Anything else is left alone.
+ * returns: 0 if nothing is at path anymore, -1 otherwise (errno is set)
+ */
+static int remove_stale(struct sockaddr_un *addr) {
+  struct stat st;
+  if (lstat(addr->sun_path, &st) == -1)
+    return errno == ENOENT ? 0 : -1;
+  if (!S_ISSOCK(st.st_mode)) {
+    errno = EEXIST;
+    return -1;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    return -1;
+  int live = connect(fd, (struct sockaddr *)addr, sizeof(*addr)) == 0,
+      err = errno;
+  close(fd);
+  if (live || err != ECONNREFUSED) {
+    errno = live ? EADDRINUSE : err;
+    return -1;
+  }
+  return unlink(addr->sun_path);
+}
+
+/* Starts listening for clients on a unix socket at path, replacing a
+ * socket left there by a previous PMan. Refuses to replace anything else,
+ * including a socket another PMan is listening on.
+ * inputs: path - path of the socket
+ *         processes - list of background processes requests act on
+ * returns: 0 on success, -1 on failure (errno is set)
+ */
+int control_start(const char *path, plist_t *processes) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  if (remove_stale(&addr) == -1)
+    return -1;
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    return -1;
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(fd, SOMAXCONN) == -1 ||
+      ev_add(fd, EPOLLIN, accept_clients, NULL) == -1) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  listen_fd = fd;
+  socket_path = strdup(path);
+  procs = processes;
+  return 0;
+}
+
+/* returns 1 if PMan is listening on a control socket, 0 otherwise */
+int control_active() { return listen_fd != -1; }
+
+/* disconnects every client, closes the socket and removes it */
+void control_stop() {
+  while (clients != NULL)
+    drop_client(clients);
+  if (listen_fd == -1)
+    return;
+  ev_del(listen_fd);
+  close(listen_fd);
+  unlink(socket_path);
+  free(socket_path);
+  listen_fd = -1;
+  socket_path = NULL;
+}
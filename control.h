@@ -0,0 +1,14 @@
+/* @file control.h
+ * @brief Header file for the unix socket control interface
+ */
+
+#include "list.h"
+
+#ifndef _CONTROL_H_
+#define _CONTROL_H_
+
+int control_start(const char *path, plist_t *processes);
+int control_active();
+void control_stop();
+
+#endif
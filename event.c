@@ -0,0 +1,160 @@
+/* @file event.c
+ * @brief Source file for the epoll based event loop. Every source of work
+ * PMan has (stdin, child exits, timers) is a file descriptor registered here,
+ * so the main loop sleeps until one of them is ready instead of polling.
+ */
+
+#include "event.h"
+#include "metrics.h"
+#include "utils.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 64
+
+// handler and argument registered for a file descriptor.
+// entries are indexed by the file descriptor itself.
+typedef struct ev_entry {
+  ev_handler handler;
+  void *data;
+  int is_timer;
+} ev_entry;
+
+static int epoll_fd = -1;
+static ev_entry *entries = NULL;
+static int n_entries = 0;
+// when epoll_wait last returned, the start of the handlers' latencies
+static long long wakeup_ns = 0;
+
+/* Creates the epoll instance used by the event loop.
+ * returns: 0 on success, -1 on failure
+ */
+int ev_init() {
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  return epoll_fd == -1 ? -1 : 0;
+}
+
+/* grows the entries table so that fd is a valid index */
+static void reserve_entry(int fd) {
+  if (fd < n_entries)
+    return;
+  int size = n_entries ? n_entries : 16;
+  while (size <= fd)
+    size *= 2;
+  entries = realloc(entries, size * sizeof(ev_entry));
+  if (entries == NULL) {
+    fprintf(stderr, "Error: realloc failed in reserve_entry");
+    exit(1);
+  }
+  for (int i = n_entries; i < size; i++) {
+    entries[i].handler = NULL;
+    entries[i].data = NULL;
+    entries[i].is_timer = 0;
+  }
+  n_entries = size;
+}
+
+/* Registers a file descriptor with the event loop.
+ * inputs: fd - file descriptor to watch
+ *         events - epoll events to watch for (EPOLLIN, EPOLLOUT, ...)
+ *         handler - callback run when fd is ready
+ *         data - argument passed to handler
+ * returns: 0 on success, -1 on failure
+ */
+int ev_add(int fd, uint32_t events, ev_handler handler, void *data) {
+  struct epoll_event ev = {.events = events, .data.fd = fd};
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1)
+    return -1;
+  reserve_entry(fd);
+  entries[fd].handler = handler;
+  entries[fd].data = data;
+  entries[fd].is_timer = 0;
+  return 0;
+}
+
+/* Changes the events a registered file descriptor is watched for */
+int ev_mod(int fd, uint32_t events) {
+  struct epoll_event ev = {.events = events, .data.fd = fd};
+  return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+/* Removes a file descriptor from the event loop. Must be called
+ * before the file descriptor is closed.
+ */
+int ev_del(int fd) {
+  if (fd < n_entries)
+    entries[fd].handler = NULL;
+  return epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/* Waits for registered file descriptors to become ready and runs their
+ * handlers.
+ * inputs: timeout - max milliseconds to wait, -1 to wait indefinitely
+ * returns: -1 if a handler requested PMan to exit, 1 if any handler
+ *          printed output, 0 otherwise.
+ */
+int ev_wait(int timeout) {
+  struct epoll_event events[MAX_EVENTS];
+  int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+  if (n == -1) {
+    if (errno == EINTR)
+      return 0;
+    perror("epoll_wait");
+    exit(1);
+  }
+  wakeup_ns = monotonic_ns();
+  metric_inc(M_WAKEUPS);
+
+  int result = 0;
+  for (int i = 0; i < n; i++) {
+    int fd = events[i].data.fd;
+    // a handler earlier in this batch may have removed this fd.
+    if (fd >= n_entries || entries[fd].handler == NULL)
+      continue;
+    if (entries[fd].is_timer) {
+      // acknowledge the expirations so the timerfd stops being readable.
+      uint64_t expirations;
+      read(fd, &expirations, sizeof(expirations));
+    }
+    int r = entries[fd].handler(fd, events[i].events, entries[fd].data);
+    if (r == -1)
+      return -1;
+    result = result || r;
+  }
+  return result;
+}
+
+/* returns the monotonic time the event loop last woke up at, in ns,
+ * or 0 if it hasn't run yet.
+ */
+long long ev_wakeup_ns() { return wakeup_ns; }
+
+/* Creates a periodic timer that runs handler every interval_ms
+ * milliseconds, starting one interval from now.
+ * returns: the timer's file descriptor, -1 on failure
+ */
+int ev_timer(int interval_ms, ev_handler handler, void *data) {
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (fd == -1)
+    return -1;
+  struct timespec interval = {.tv_sec = interval_ms / 1000,
+                              .tv_nsec = (interval_ms % 1000) * 1000000L};
+  struct itimerspec spec = {.it_interval = interval, .it_value = interval};
+  if (timerfd_settime(fd, 0, &spec, NULL) == -1 ||
+      ev_add(fd, EPOLLIN, handler, data) == -1) {
+    close(fd);
+    return -1;
+  }
+  entries[fd].is_timer = 1;
+  return fd;
+}
+
+/* stops and closes a timer created by ev_timer */
+void ev_timer_stop(int fd) {
+  ev_del(fd);
+  close(fd);
+}
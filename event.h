@@ -0,0 +1,25 @@
+/* @file event.h
+ * @brief Header file for the epoll based event loop
+ */
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+#ifndef _EVENT_H_
+#define _EVENT_H_
+
+// callback run when a registered file descriptor becomes ready.
+// should return -1 if PMan needs to exit, 1 if it printed output
+// (meaning a new prompt is needed) and 0 otherwise.
+typedef int (*ev_handler)(int fd, uint32_t events, void *data);
+
+int ev_init();
+int ev_add(int fd, uint32_t events, ev_handler handler, void *data);
+int ev_mod(int fd, uint32_t events);
+int ev_del(int fd);
+int ev_wait(int timeout);
+long long ev_wakeup_ns();
+int ev_timer(int interval_ms, ev_handler handler, void *data);
+void ev_timer_stop(int fd);
+
+#endif
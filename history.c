@@ -0,0 +1,323 @@
+/* @file history.c
+ * @brief Source file for the history of completed background processes.
+ * When a background process is done, its wall time, cpu time, max rss,
+ * page faults and exit status (from the rusage wait4 returns) are kept in
+ * a ring buffer of the last PMAN_HISTORY (default 1000) processes, and
+ * listed by bghist. Command names are interned, so a ring full of the same
+ * command holds one copy of it.
+ */
+
+#include "history.h"
+#include "intern.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#define DEFAULT_HISTORY 1000
+// entries bghist shows without -n
+#define DEFAULT_SHOWN 20
+
+// a completed background process
+typedef struct hist_entry {
+  const char *name;
+  pid_t pid;
+  // wait status, -1 if it isn't known
+  int status;
+  // CLOCK_BOOTTIME the process was started and found done at, in ns
+  long long start_ns;
+  long long end_ns;
+  // 0 if the process wasn't reaped by PMan and its usage isn't known
+  int has_usage;
+  long long utime_us;
+  long long stime_us;
+  long maxrss_kb;
+  long minflt;
+  long majflt;
+
+} hist_entry;
+
+static const char *hist_sort_names[] = {"end", "wall", "cpu", "rss",
+                                        "faults"};
+// order select_entries sorts by, for compare_entries
+static enum hist_sort hist_sort_by;
+
+static hist_entry *ring = NULL;
+static int capacity = DEFAULT_HISTORY;
+// entries in the ring, and the slot of the next one
+static int used = 0;
+static int next = 0;
+// processes completed since PMan started, including ones no longer kept
+static long long completed = 0;
+
+/* sets how many completed processes are kept, 0 keeps none. Only takes
+ * effect before the first one is added.
+ */
+void hist_set_size(int size) {
+  if (ring == NULL)
+    capacity = size;
+}
+
+/* returns a timeval in microseconds */
+static long long tv_us(struct timeval tv) {
+  return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+/* Adds a completed background process to the history, replacing the
+ * oldest one once the history is full.
+ * inputs: process - the process
+ *         status - its wait status, -1 if it isn't known
+ *         usage - its resource usage, NULL if it isn't known
+ */
+void hist_add(process_t *process, int status, const struct rusage *usage) {
+  completed++;
+  if (capacity <= 0)
+    return;
+  if (ring == NULL) {
+    ring = calloc(capacity, sizeof(hist_entry));
+    if (ring == NULL) {
+      fprintf(stderr, "Error: calloc failed in hist_add");
+      exit(1);
+    }
+  }
+  hist_entry *entry = &ring[next];
+  if (entry->name != NULL)
+    intern_release(entry->name);
+  entry->name = intern(process->name);
+  entry->pid = process->pid;
+  entry->status = status;
+  entry->start_ns = process->start_ns;
+  entry->end_ns = boottime_ns();
+  entry->has_usage = usage != NULL;
+  if (usage != NULL) {
+    entry->utime_us = tv_us(usage->ru_utime);
+    entry->stime_us = tv_us(usage->ru_stime);
+    entry->maxrss_kb = usage->ru_maxrss;
+    entry->minflt = usage->ru_minflt;
+    entry->majflt = usage->ru_majflt;
+  }
+  next = (next + 1) % capacity;
+  if (used < capacity)
+    used++;
+}
+
+/* sets bghist options to their defaults: the last DEFAULT_SHOWN processes,
+ * most recent first, as text
+ */
+void init_hist_opts(hist_opts *opts) {
+  opts->match = NULL;
+  opts->sort = HIST_END;
+  opts->count = DEFAULT_SHOWN;
+  opts->json = 0;
+}
+
+/* Parses the options of bghist:
+ *   -m text            only processes whose command contains text
+ *   -o end|wall|cpu|rss|faults  sort by completion (most recent first),
+ *                      or by wall time, cpu time, max rss or page faults
+ *                      (highest first)
+ *   -n count           show count processes
+ *   --json             print JSON instead of a table
+ * returns: NULL on success, a description of the error otherwise
+ */
+const char *parse_hist_opts(char *args[], hist_opts *opts) {
+  static char error[128];
+  for (int i = 0; args[i] != NULL; i++) {
+    char *opt = args[i], *val = args[i + 1];
+    if (strcmp(opt, "--json") == 0) {
+      opts->json = 1;
+      continue;
+    }
+    if (strcmp(opt, "-m") != 0 && strcmp(opt, "-o") != 0 &&
+        strcmp(opt, "-n") != 0) {
+      snprintf(error, sizeof(error), "Unknown option \"%.64s\"", opt);
+      return error;
+    }
+    if (val == NULL) {
+      snprintf(error, sizeof(error), "Expected a value after %s", opt);
+      return error;
+    }
+    i++;
+    if (strcmp(opt, "-m") == 0) {
+      opts->match = val;
+    } else if (strcmp(opt, "-o") == 0) {
+      int sort = 0;
+      while (sort < 5 && strcmp(val, hist_sort_names[sort]) != 0)
+        sort++;
+      if (sort == 5)
+        return "Invalid order, expected end, wall, cpu, rss or faults";
+      opts->sort = sort;
+    } else if (atoi(val) <= 0) {
+      return "Expected a positive number after -n";
+    } else {
+      opts->count = atoi(val);
+    }
+  }
+  return NULL;
+}
+
+/* value an entry is sorted by, highest first. Entries without usage sort
+ * last when sorted by it.
+ */
+static double hist_key(hist_entry *entry) {
+  switch (hist_sort_by) {
+  case HIST_WALL:
+    return entry->end_ns - entry->start_ns;
+  case HIST_CPU:
+    return entry->has_usage ? entry->utime_us + entry->stime_us : -1;
+  case HIST_RSS:
+    return entry->has_usage ? entry->maxrss_kb : -1;
+  case HIST_FAULTS:
+    return entry->has_usage ? entry->minflt + entry->majflt : -1;
+  default:
+    return entry->end_ns;
+  }
+}
+
+/* qsort comparator, orders entries by descending hist_key then most
+ * recent first
+ */
+static int compare_entries(const void *a, const void *b) {
+  hist_entry *ea = *(hist_entry **)a, *eb = *(hist_entry **)b;
+  double ka = hist_key(ea), kb = hist_key(eb);
+  if (ka != kb)
+    return (ka < kb) - (ka > kb);
+  return (ea->end_ns < eb->end_ns) - (ea->end_ns > eb->end_ns);
+}
+
+/* Selects the entries bghist shows, in order.
+ * returns: the number of entries that match the filter, with them in
+ *          rows (malloc'd, NULL if none match)
+ */
+static int select_entries(hist_opts *opts, hist_entry ***rows) {
+  *rows = NULL;
+  if (used == 0)
+    return 0;
+  *rows = malloc(used * sizeof(hist_entry *));
+  if (*rows == NULL) {
+    fprintf(stderr, "Error: malloc failed in select_entries");
+    exit(1);
+  }
+  // the ring is walked from the most recent entry back
+  int n = 0;
+  for (int i = 1; i <= used; i++) {
+    hist_entry *entry = &ring[(next - i + capacity) % capacity];
+    if (opts->match == NULL || strstr(entry->name, opts->match) != NULL)
+      (*rows)[n++] = entry;
+  }
+  if (opts->sort != HIST_END) {
+    hist_sort_by = opts->sort;
+    qsort(*rows, n, sizeof(hist_entry *), compare_entries);
+  }
+  return n;
+}
+
+/* describes how a process ended, like "exit 0" or "signal 9" */
+static void describe_status(int status, char *buf, int size) {
+  if (status == -1)
+    snprintf(buf, size, "unknown");
+  else if (WIFSIGNALED(status))
+    snprintf(buf, size, "signal %d", WTERMSIG(status));
+  else
+    snprintf(buf, size, "exit %d", WEXITSTATUS(status));
+}
+
+/* Appends the completed processes bghist would show to out as the members
+ * of a JSON object: "total" (kept processes matching the filter),
+ * "completed" (every process completed since PMan started) and "history",
+ * an array with pid, name, exit code or signal, start and end time, and
+ * wall, user and sys time in seconds, max rss in KiB and page faults
+ * (null if they aren't known).
+ */
+void hist_json(hist_opts *opts, strbuf_t *out) {
+  hist_entry **rows;
+  int n = select_entries(opts, &rows), shown = n < opts->count ? n : opts->count;
+  sb_printf(out, "\"total\": %d, \"completed\": %lld, \"history\": [", n,
+            completed);
+  for (int i = 0; i < shown; i++) {
+    hist_entry *entry = rows[i];
+    sb_printf(out, "%s{\"pid\": %d, \"name\": ", i == 0 ? "" : ", ",
+              entry->pid);
+    sb_json_str(out, entry->name);
+    if (entry->status == -1)
+      sb_printf(out, ", \"exit_code\": null, \"signal\": null");
+    else if (WIFSIGNALED(entry->status))
+      sb_printf(out, ", \"exit_code\": null, \"signal\": %d",
+                WTERMSIG(entry->status));
+    else
+      sb_printf(out, ", \"exit_code\": %d, \"signal\": null",
+                WEXITSTATUS(entry->status));
+    sb_printf(out, ", \"start_ns\": %lld, \"end_ns\": %lld, \"wall_s\": %.3f",
+              entry->start_ns, entry->end_ns,
+              (entry->end_ns - entry->start_ns) / 1e9);
+    if (entry->has_usage)
+      sb_printf(out,
+                ", \"user_s\": %.3f, \"sys_s\": %.3f, \"maxrss_kb\": %ld, "
+                "\"minflt\": %ld, \"majflt\": %ld}",
+                entry->utime_us / 1e6, entry->stime_us / 1e6,
+                entry->maxrss_kb, entry->minflt, entry->majflt);
+    else
+      sb_printf(out, ", \"user_s\": null, \"sys_s\": null, \"maxrss_kb\": "
+                     "null, \"minflt\": null, \"majflt\": null}");
+  }
+  sb_printf(out, "]");
+  free(rows);
+}
+
+/* Prints the completed background processes as a table, built in one
+ * buffer and written at once. See parse_hist_opts for the options.
+ */
+void print_history(hist_opts *opts) {
+  strbuf_t out;
+  sb_init(&out);
+  if (opts->json) {
+    sb_printf(&out, "{");
+    hist_json(opts, &out);
+    sb_printf(&out, "}\n");
+    fwrite(out.data, 1, out.len, stdout);
+    sb_free(&out);
+    return;
+  }
+  hist_entry **rows;
+  int n = select_entries(opts, &rows), shown = n < opts->count ? n : opts->count;
+  if (n == 0) {
+    printf("No completed background processes\n");
+    free(rows);
+    return;
+  }
+  sb_printf(&out, "%8s %-10s %9s %9s %9s %10s %9s %7s %s\n", "PID", "STATUS",
+            "WALL(s)", "USER(s)", "SYS(s)", "RSS(KiB)", "MINFLT", "MAJFLT",
+            "COMMAND");
+  char status[32];
+  for (int i = 0; i < shown; i++) {
+    hist_entry *entry = rows[i];
+    describe_status(entry->status, status, sizeof(status));
+    sb_printf(&out, "%8d %-10s %9.2f ", entry->pid, status,
+              (entry->end_ns - entry->start_ns) / 1e9);
+    if (entry->has_usage)
+      sb_printf(&out, "%9.2f %9.2f %10ld %9ld %7ld", entry->utime_us / 1e6,
+                entry->stime_us / 1e6, entry->maxrss_kb, entry->minflt,
+                entry->majflt);
+    else
+      sb_printf(&out, "%9s %9s %10s %9s %7s", "-", "-", "-", "-", "-");
+    sb_printf(&out, " %s\n", entry->name);
+  }
+  sb_printf(&out, "Showing %d of %d kept, %lld completed since start\n", shown,
+            n, completed);
+  fwrite(out.data, 1, out.len, stdout);
+  sb_free(&out);
+  free(rows);
+}
+
+/* frees the history */
+void hist_free() {
+  for (int i = 0; ring != NULL && i < capacity; i++) {
+    if (ring[i].name != NULL)
+      intern_release(ring[i].name);
+  }
+  free(ring);
+  ring = NULL;
+  used = 0;
+  next = 0;
+}
@@ -0,0 +1,32 @@
+/* @file history.h
+ * @brief Header file for the history of completed background processes
+ */
+
+#include "list.h"
+#include "utils.h"
+#include <sys/resource.h>
+
+#ifndef _HISTORY_H_
+#define _HISTORY_H_
+
+// what bghist sorts by
+enum hist_sort { HIST_END, HIST_WALL, HIST_CPU, HIST_RSS, HIST_FAULTS };
+
+// options of bghist, see parse_hist_opts
+typedef struct hist_opts {
+  const char *match;
+  enum hist_sort sort;
+  int count;
+  int json;
+
+} hist_opts;
+
+void hist_set_size(int size);
+void hist_add(process_t *process, int status, const struct rusage *usage);
+void init_hist_opts(hist_opts *opts);
+const char *parse_hist_opts(char *args[], hist_opts *opts);
+void hist_json(hist_opts *opts, strbuf_t *out);
+void print_history(hist_opts *opts);
+void hist_free();
+
+#endif
@@ -0,0 +1,193 @@
+/* @file intern.c
+ * @brief Source file for interned command strings. Every distinct string
+ * is stored once, in an arena, and shared by reference count, so thousands
+ * of processes started with the same command (e.g. by bgn) share a single
+ * copy. Strings are allocated in 16 byte size classes from 64KB arena
+ * chunks, and released ones go on a free list of their class to be reused,
+ * so they don't fragment the heap.
+ */
+
+#include "intern.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHUNK_SIZE (64 * 1024)
+#define CLASS_SIZE 16
+// largest string kept in the arena, longer ones are allocated on their own
+#define MAX_ARENA_STR (CHUNK_SIZE / 4)
+
+// an interned string, with its text right after the header
+typedef struct istr {
+  // next string of the same size class, while it is on a free list
+  struct istr *next_free;
+  uint32_t refs;
+  uint32_t hash;
+  char str[];
+
+} istr;
+
+// arena chunk, strings are carved from data
+typedef struct chunk {
+  struct chunk *next;
+  size_t used;
+  char data[];
+
+} chunk;
+
+static chunk *chunks = NULL;
+static istr *free_lists[MAX_ARENA_STR / CLASS_SIZE + 1];
+// open addressing table of the interned strings, capacity a power of two
+static istr **table = NULL;
+static uint32_t capacity = 0;
+static uint32_t used = 0;
+
+/* FNV-1a hash of a string */
+static uint32_t hash_str(const char *s) {
+  uint32_t h = 2166136261u;
+  for (; *s != '\0'; s++)
+    h = (h ^ (unsigned char)*s) * 16777619u;
+  return h;
+}
+
+/* returns the header of an interned string */
+static istr *header_of(const char *s) {
+  return (istr *)(s - offsetof(istr, str));
+}
+
+/* returns the size class of a string of length len */
+static size_t size_class(size_t len) {
+  return (sizeof(istr) + len + 1 + CLASS_SIZE - 1) / CLASS_SIZE;
+}
+
+/* finds the slot of s in the table, or the empty slot it belongs in */
+static istr **find_slot(const char *s, uint32_t hash) {
+  uint32_t mask = capacity - 1, i = hash & mask;
+  while (table[i] != NULL &&
+         (table[i]->hash != hash || strcmp(table[i]->str, s) != 0))
+    i = (i + 1) & mask;
+  return &table[i];
+}
+
+/* doubles the table, rehashing every string */
+static void grow_table() {
+  istr **old = table;
+  uint32_t old_capacity = capacity;
+  capacity = capacity ? capacity * 2 : 256;
+  table = calloc(capacity, sizeof(istr *));
+  if (table == NULL) {
+    fprintf(stderr, "Error: calloc failed in grow_table");
+    exit(1);
+  }
+  for (uint32_t i = 0; i < old_capacity; i++) {
+    if (old[i] != NULL)
+      *find_slot(old[i]->str, old[i]->hash) = old[i];
+  }
+  free(old);
+}
+
+/* allocates room for a string of length len, from the free list of its
+ * size class or the current arena chunk.
+ */
+static istr *alloc_str(size_t len) {
+  size_t class = size_class(len), size = class * CLASS_SIZE;
+  istr *s;
+  if (size > MAX_ARENA_STR) {
+    s = malloc(size);
+  } else if (free_lists[class] != NULL) {
+    s = free_lists[class];
+    free_lists[class] = s->next_free;
+    return s;
+  } else {
+    if (chunks == NULL || chunks->used + size > CHUNK_SIZE) {
+      chunk *c = malloc(sizeof(chunk) + CHUNK_SIZE);
+      if (c == NULL) {
+        fprintf(stderr, "Error: malloc failed in alloc_str");
+        exit(1);
+      }
+      c->next = chunks;
+      c->used = 0;
+      chunks = c;
+    }
+    s = (istr *)(chunks->data + chunks->used);
+    chunks->used += size;
+  }
+  if (s == NULL) {
+    fprintf(stderr, "Error: malloc failed in alloc_str");
+    exit(1);
+  }
+  return s;
+}
+
+/* Interns a string, taking a reference to it.
+ * returns: the shared copy of s, valid until it is released with
+ *          intern_release as many times as it was interned
+ */
+const char *intern(const char *s) {
+  if (capacity == 0 || 2 * (used + 1) > capacity)
+    grow_table();
+  uint32_t hash = hash_str(s);
+  istr **slot = find_slot(s, hash);
+  if (*slot == NULL) {
+    size_t len = strlen(s);
+    istr *new_str = alloc_str(len);
+    new_str->refs = 0;
+    new_str->hash = hash;
+    memcpy(new_str->str, s, len + 1);
+    *slot = new_str;
+    used++;
+  }
+  (*slot)->refs++;
+  return (*slot)->str;
+}
+
+/* removes the string in table slot 'hole', shifting back any strings
+ * after it in the same probe sequence so no tombstones are needed.
+ */
+static void table_remove(uint32_t hole) {
+  uint32_t mask = capacity - 1, i = (hole + 1) & mask;
+  while (table[i] != NULL) {
+    uint32_t home = table[i]->hash & mask;
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      table[hole] = table[i];
+      hole = i;
+    }
+    i = (i + 1) & mask;
+  }
+  table[hole] = NULL;
+  used--;
+}
+
+/* Drops a reference to a string returned by intern. The last one frees
+ * the string for reuse.
+ */
+void intern_release(const char *s) {
+  istr *str = header_of(s);
+  if (--str->refs > 0)
+    return;
+  table_remove(find_slot(s, str->hash) - table);
+  size_t class = size_class(strlen(s));
+  if (class * CLASS_SIZE > MAX_ARENA_STR) {
+    free(str);
+    return;
+  }
+  str->next_free = free_lists[class];
+  free_lists[class] = str;
+}
+
+/* frees the arena once no strings are left in it */
+void intern_cleanup() {
+  if (used > 0)
+    return;
+  while (chunks != NULL) {
+    chunk *next = chunks->next;
+    free(chunks);
+    chunks = next;
+  }
+  memset(free_lists, 0, sizeof(free_lists));
+  free(table);
+  table = NULL;
+  capacity = 0;
+}
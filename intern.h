@@ -0,0 +1,12 @@
+/* @file intern.h
+ * @brief Header file for interned command strings
+ */
+
+#ifndef _INTERN_H_
+#define _INTERN_H_
+
+const char *intern(const char *s);
+void intern_release(const char *s);
+void intern_cleanup();
+
+#endif
@@ -0,0 +1,169 @@
+/* @file jobqueue.c
+ * @brief Source file for the bounded concurrency queue of background jobs.
+ * Commands pushed with bgqueue wait in a FIFO list of QUEUED processes, and
+ * are started as soon as fewer than max_running background processes are
+ * tracked by PMan. Commands held by admission control (see admission.c)
+ * wait in the same queue, which is re-checked every RECHECK_MS while
+ * admission control holds it, so they are started as pressure drops.
+ */
+
+#include "jobqueue.h"
+#include "admission.h"
+#include "event.h"
+#include "list.h"
+#include "process.h"
+#include "utils.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// max arguments of a queued command, same as commands typed into PMan
+#define QUEUE_MAX_ARGS 100
+// how often the queue is retried while admission control holds it, in ms
+#define RECHECK_MS 500
+
+static plist_t *queue = NULL;
+// queued jobs have no pid yet, so they are keyed by a negative sequence
+// number in the queue's pid index instead.
+static int next_id = 1;
+static int max_running = 0;
+// timer retrying the queue while it's held, -1 when it isn't
+static int recheck_fd = -1;
+
+/* returns the queue, creating it on first use */
+plist_t *queued_jobs() {
+  if (queue == NULL)
+    queue = create_list();
+  return queue;
+}
+
+/* sets the max number of background processes queued jobs may run next to,
+ * 0 or less resets it to the number of online cpus.
+ */
+void set_max_running(int max) { max_running = max; }
+
+/* returns the max number of running background processes */
+int get_max_running() {
+  if (max_running <= 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? cpus : 1;
+  }
+  return max_running;
+}
+
+/* Adds a command to the end of the queue.
+ * inputs: args - the command and its arguments
+ */
+void queue_push(char *args[]) {
+  char name[LINE_MAX];
+  name[0] = '\0';
+  concat_strs(name, args, LINE_MAX);
+  add_at_end(queued_jobs(), new_node(-(next_id++), name, QUEUED));
+}
+
+/* Adds a command held by admission control to the end of the queue. It's
+ * started as soon as admission control admits it, however many background
+ * processes are running, like bg would have.
+ * inputs: args - the command and its arguments
+ */
+void queue_hold(char *args[]) {
+  queue_push(args);
+  queue->tail->admit_held = 1;
+}
+
+/* Adds a bgn batch held by admission control to the end of the queue,
+ * started like fork_batch, see queue_hold.
+ * inputs: args - the command and its arguments
+ *         first - PMAN_INDEX of the first instance
+ *         count - the number of instances
+ */
+void queue_push_batch(char *args[], int first, int count) {
+  queue_hold(args);
+  queue->tail->batch_index = first;
+  queue->tail->batch_left = count;
+}
+
+/* timer handler retrying the queue while admission control holds it */
+static int recheck(int fd, uint32_t events, void *data) {
+  return queue_run(data) > 0;
+}
+
+/* Starts queued jobs, oldest first, until admission control holds new ones
+ * or the queue is empty. Jobs pushed with bgqueue are only started while
+ * fewer than max_running background processes are tracked, jobs held by
+ * admission control regardless. Prints one summary of the jobs started.
+ * inputs: processes - list of background processes
+ * returns: the number of queued jobs (or instances of batches) started
+ */
+int queue_run(plist_t *processes) {
+  if (queue == NULL || queue->size == 0)
+    return 0;
+  int max = get_max_running(), started = 0;
+  const char *held = NULL;
+  char cmd[LINE_MAX];
+  char *args[QUEUE_MAX_ARGS];
+  process_t *job = queue->head, *next;
+  for (; job != NULL && (held = admit_check()) == NULL; job = next) {
+    next = job->next;
+    if (!job->admit_held && processes->size >= max)
+      continue;
+    // the queued name is the command split back into its arguments
+    strcpy(cmd, job->name);
+    int i = 0;
+    for (char *token = strtok(cmd, " "); token != NULL && i < QUEUE_MAX_ARGS - 1;
+         token = strtok(NULL, " "))
+      args[i++] = token;
+    args[i] = NULL;
+    if (job->batch_left > 0 && i > 0) {
+      // a batch runs as many instances as fit, and stays queued until
+      // all of them were started
+      int err, count = job->admit_held ? job->batch_left
+                                       : max - processes->size;
+      pid_t first, last;
+      if (count > job->batch_left)
+        count = job->batch_left;
+      int n = start_batch(args, job->batch_index, count, processes, &first,
+                          &last, &err);
+      started += n;
+      job->batch_index += n;
+      job->batch_left -= n;
+      // what is left waits for room, or for admission control
+      if (err == 0 && job->batch_left > 0)
+        continue;
+      if (err != 0)
+        launch_error(args[0], err);
+    } else if (i > 0 && fork_process(args, processes, BG) > 0) {
+      started++;
+    }
+    remove_by_pid(queue, job->pid);
+  }
+  // retry later while admission control holds the queue. A batch that
+  // admission control stopped may have been the last job checked.
+  if (queue->size > 0)
+    held = admit_check();
+  if (held != NULL && queue->size > 0 && recheck_fd == -1)
+    recheck_fd = ev_timer(RECHECK_MS, recheck, processes);
+  else if ((held == NULL || queue->size == 0) && recheck_fd != -1) {
+    ev_timer_stop(recheck_fd);
+    recheck_fd = -1;
+  }
+  if (started) {
+    char msg[100];
+    snprintf(msg, sizeof(msg), "  - Started %d queued process%s (%d queued)",
+             started, started == 1 ? "" : "es", queue->size);
+    msg_on_prev_line(msg);
+  }
+  return started;
+}
+
+/* frees the queue and any jobs still in it */
+void free_queue() {
+  if (queue != NULL)
+    free_list(queue);
+  queue = NULL;
+  if (recheck_fd != -1)
+    ev_timer_stop(recheck_fd);
+  recheck_fd = -1;
+}
@@ -0,0 +1,19 @@
+/* @file jobqueue.h
+ * @brief Header file for the bounded concurrency queue of background jobs
+ */
+
+#include "list.h"
+
+#ifndef _JOBQUEUE_H_
+#define _JOBQUEUE_H_
+
+void queue_push(char *args[]);
+void queue_hold(char *args[]);
+void queue_push_batch(char *args[], int first, int count);
+int queue_run(plist_t *processes);
+plist_t *queued_jobs();
+void set_max_running(int max);
+int get_max_running();
+void free_queue();
+
+#endif
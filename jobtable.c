@@ -0,0 +1,302 @@
+/* @file jobtable.c
+ * @brief Source file for the persistent table of background processes.
+ * Every background process has a fixed size slot in a file mapped with
+ * MAP_SHARED, which is written in place as processes start, change state
+ * and exit. The table lives in the page cache, so it survives PMan dying
+ * however it dies, and a new PMan maps it and re-adopts the processes that
+ * are still running without parsing anything.
+ *
+ * A re-adopted process is not a child of the new PMan (orphans are
+ * reparented to the nearest subreaper, or init), so it can't be reaped
+ * with waitpid. It is watched through a pidfd instead, which becomes
+ * readable when the process exits.
+ */
+
+#define _GNU_SOURCE
+#include "jobtable.h"
+#include "event.h"
+#include "history.h"
+#include "list.h"
+#include "sampler.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define JT_MAGIC "PMANJT1"
+#define SLOT_SIZE 256
+#define NAME_LEN (SLOT_SIZE - 24)
+// slots of a new table, the table doubles whenever it is full
+#define INITIAL_SLOTS 1024
+// most a process' start time in /proc may differ from the recorded one
+// for it to be the same process, rather than a reused pid
+#define START_SLACK_NS 2000000000LL
+
+// first slot of the file, describes the table
+typedef struct jt_header {
+  char magic[8];
+  uint32_t slot_size;
+  uint32_t capacity;
+  char pad[SLOT_SIZE - 16];
+
+} jt_header;
+
+// a background process. pid is written last when a slot is filled and
+// first when it is freed, so a slot with a pid is always complete.
+typedef struct jt_slot {
+  int32_t pid;
+  int32_t pgid;
+  int32_t state;
+  int32_t pad;
+  int64_t start_ns;
+  char name[NAME_LEN];
+
+} jt_slot;
+
+static int table_fd = -1;
+static char *table = NULL;
+static uint32_t capacity = 0;
+// indices of the free slots, used as a stack
+static int *free_slots = NULL;
+static int n_free = 0;
+static plist_t *procs = NULL;
+
+/* returns slot i of the table, slot indices start at 0 after the header */
+static jt_slot *slot_at(int i) {
+  return (jt_slot *)(table + (size_t)(i + 1) * SLOT_SIZE);
+}
+
+/* maps the table with room for 'slots' slots, growing the file if needed.
+ * returns: 0 on success, -1 on failure
+ */
+static int map_table(uint32_t slots) {
+  size_t size = (size_t)(slots + 1) * SLOT_SIZE;
+  if (ftruncate(table_fd, size) == -1)
+    return -1;
+  char *mapped = table == NULL
+                     ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                            table_fd, 0)
+                     : mremap(table, (size_t)(capacity + 1) * SLOT_SIZE, size,
+                              MREMAP_MAYMOVE);
+  if (mapped == MAP_FAILED)
+    return -1;
+  table = mapped;
+  int *grown = realloc(free_slots, slots * sizeof(int));
+  if (grown == NULL) {
+    fprintf(stderr, "Error: realloc failed in map_table");
+    exit(1);
+  }
+  free_slots = grown;
+  // new slots are pushed in reverse so the lowest is handed out first
+  for (uint32_t i = slots; i > capacity; i--)
+    free_slots[n_free++] = i - 1;
+  capacity = slots;
+  ((jt_header *)table)->capacity = capacity;
+  return 0;
+}
+
+/* event handler for the pidfd of a re-adopted process, reports its exit.
+ * Its exit status and resource usage went to whoever it was reparented to.
+ */
+static int adopted_exit(int fd, uint32_t events, void *data) {
+  process_t *process = data;
+  char msg[64];
+  snprintf(msg, sizeof(msg), "  - Process %d has exited", process->pid);
+  msg_on_prev_line(msg);
+  hist_add(process, -1, NULL);
+  jt_remove(process);
+  remove_by_pid(procs, process->pid);
+  return 1;
+}
+
+/* Re-adopts the process in slot i if it is still running, freeing the slot
+ * otherwise. A process is only re-adopted if its start time matches the
+ * recorded one, so an unrelated process that reused the pid isn't.
+ * returns: 1 if the process was re-adopted, 0 otherwise
+ */
+static int adopt(int i) {
+  jt_slot *slot = slot_at(i);
+  pstat_t st;
+  // the pidfd is opened first, it fails without touching /proc for
+  // processes that are gone, and refers to this process from then on.
+  int pidfd = syscall(SYS_pidfd_open, slot->pid, 0);
+  if (pidfd == -1 || read_stat(slot->pid, &st) == -1 || st.state == 'Z' ||
+      llabs((long long)(st.starttime * (1e9 / sysconf(_SC_CLK_TCK))) -
+            slot->start_ns) > START_SLACK_NS) {
+    if (pidfd != -1)
+      close(pidfd);
+    slot->pid = 0;
+    return 0;
+  }
+
+  char name[LINE_MAX];
+  snprintf(name, sizeof(name), "%.*s", NAME_LEN, slot->name);
+  process_t *process = new_node(slot->pid, name, slot->state);
+  process->pgid = slot->pgid;
+  process->start_ns = slot->start_ns;
+  process->slot = i;
+  process->pidfd = pidfd;
+  if (ev_add(pidfd, EPOLLIN, adopted_exit, process) == -1) {
+    close(pidfd);
+    process->pidfd = -1;
+  }
+  add_at_end(procs, process);
+  return 1;
+}
+
+/* Opens the job table at path, creating it if it doesn't exist, and
+ * re-adopts every process in it that is still running into processes.
+ * The table is locked, so only one PMan uses it at a time. The default
+ * path is in /tmp, so a symlink there is never followed, and a file that
+ * isn't a regular file of the user's, or isn't empty and has no table
+ * header, is left alone rather than overwritten.
+ * returns: the number of processes re-adopted, -1 if the table couldn't be
+ *          opened (errno is set, EWOULDBLOCK if another PMan has it, EPERM
+ *          if it isn't a regular file owned by the user, EINVAL if it
+ *          isn't a job table)
+ */
+int jt_open(const char *path, plist_t *processes) {
+  table_fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+  if (table_fd == -1)
+    return -1;
+  struct stat sb;
+  int err = 0;
+  if (fstat(table_fd, &sb) == -1)
+    err = errno;
+  else if (!S_ISREG(sb.st_mode) || sb.st_uid != geteuid())
+    err = EPERM;
+  else if (flock(table_fd, LOCK_EX | LOCK_NB) == -1)
+    err = errno;
+  if (err != 0) {
+    close(table_fd);
+    table_fd = -1;
+    errno = err;
+    return -1;
+  }
+  procs = processes;
+
+  // the header is read through pread, the mapping is sized from it
+  jt_header header;
+  int valid = sb.st_size >= SLOT_SIZE &&
+              pread(table_fd, &header, sizeof(header), 0) == sizeof(header) &&
+              memcmp(header.magic, JT_MAGIC, sizeof(JT_MAGIC)) == 0 &&
+              header.slot_size == SLOT_SIZE &&
+              (off_t)(header.capacity + 1) * SLOT_SIZE <= sb.st_size;
+  uint32_t slots = valid ? header.capacity : INITIAL_SLOTS;
+  // only an empty file (a new table) is made into one
+  if (!valid && sb.st_size > 0) {
+    jt_close();
+    errno = EINVAL;
+    return -1;
+  }
+  if (map_table(slots) == -1) {
+    int err = errno;
+    jt_close();
+    errno = err;
+    return -1;
+  }
+  memcpy(((jt_header *)table)->magic, JT_MAGIC, sizeof(JT_MAGIC));
+  ((jt_header *)table)->slot_size = SLOT_SIZE;
+  if (!valid)
+    return 0;
+
+  // adopt the processes that are left, then rebuild the free slots stack
+  // from the slots that are empty now.
+  int adopted = 0;
+  for (uint32_t i = 0; i < capacity; i++) {
+    if (slot_at(i)->pid > 0)
+      adopted += adopt(i);
+  }
+  n_free = 0;
+  for (int i = capacity - 1; i >= 0; i--) {
+    if (slot_at(i)->pid <= 0)
+      free_slots[n_free++] = i;
+  }
+  return adopted;
+}
+
+/* returns where the job table is kept unless PMAN_JOBTABLE says otherwise,
+ * $XDG_RUNTIME_DIR/pman.jobs or /tmp/pman-[uid].jobs
+ */
+const char *jt_default_path() {
+  static char path[PATH_MAX];
+  char *dir = getenv("XDG_RUNTIME_DIR");
+  if (dir != NULL && dir[0] != '\0')
+    snprintf(path, sizeof(path), "%s/pman.jobs", dir);
+  else
+    snprintf(path, sizeof(path), "/tmp/pman-%d.jobs", getuid());
+  return path;
+}
+
+/* Records a new background process in the table. Does nothing if no
+ * table is open.
+ */
+void jt_add(process_t *process) {
+  if (table == NULL)
+    return;
+  if (n_free == 0 && map_table(capacity * 2) == -1)
+    return;
+  int i = free_slots[--n_free];
+  jt_slot *slot = slot_at(i);
+  if (process->start_ns == 0)
+    process->start_ns = boottime_ns();
+  slot->pgid = process->pgid;
+  slot->state = process->state;
+  slot->start_ns = process->start_ns;
+  strncpy(slot->name, process->name, NAME_LEN - 1);
+  slot->name[NAME_LEN - 1] = '\0';
+  // the slot only becomes valid once everything else is written
+  __atomic_store_n(&slot->pid, process->pid, __ATOMIC_RELEASE);
+  process->slot = i;
+}
+
+/* records a change of a background process' state, or of the pid it's
+ * listed under
+ */
+void jt_update(process_t *process) {
+  if (table != NULL && process->slot != -1) {
+    jt_slot *slot = slot_at(process->slot);
+    slot->state = process->state;
+    __atomic_store_n(&slot->pid, process->pid, __ATOMIC_RELEASE);
+  }
+}
+
+/* Removes a background process from the table, and stops watching it if
+ * it was re-adopted. Must be called before the process is removed from the
+ * process list.
+ */
+void jt_remove(process_t *process) {
+  if (process->pidfd != -1) {
+    ev_del(process->pidfd);
+    close(process->pidfd);
+    process->pidfd = -1;
+  }
+  if (table == NULL || process->slot == -1)
+    return;
+  __atomic_store_n(&slot_at(process->slot)->pid, 0, __ATOMIC_RELEASE);
+  free_slots[n_free++] = process->slot;
+  process->slot = -1;
+}
+
+/* unmaps and unlocks the table */
+void jt_close() {
+  if (table != NULL)
+    munmap(table, (size_t)(capacity + 1) * SLOT_SIZE);
+  if (table_fd != -1)
+    close(table_fd);
+  free(free_slots);
+  table = NULL;
+  table_fd = -1;
+  free_slots = NULL;
+  capacity = 0;
+  n_free = 0;
+}
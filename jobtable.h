@@ -0,0 +1,17 @@
+/* @file jobtable.h
+ * @brief Header file for the persistent table of background processes
+ */
+
+#include "list.h"
+
+#ifndef _JOBTABLE_H_
+#define _JOBTABLE_H_
+
+int jt_open(const char *path, plist_t *processes);
+const char *jt_default_path();
+void jt_add(process_t *process);
+void jt_update(process_t *process);
+void jt_remove(process_t *process);
+void jt_close();
+
+#endif
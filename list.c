@@ -3,40 +3,189 @@
  */
 
 #include "list.h"
+#include "intern.h"
+#include "sampler.h"
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#define INITIAL_CAPACITY 64
+// process records are allocated this many at a time
+#define NODES_PER_SLAB 256
+
+// a block of process records. Records are carved from slabs rather than
+// allocated one by one, so nodes started together sit next to each other,
+// and freed ones are kept on a free list to be reused first.
+typedef struct slab_t {
+  struct slab_t *next;
+  process_t nodes[NODES_PER_SLAB];
+
+} slab_t;
+
+static slab_t *slabs = NULL;
+// free records, linked through their next pointers
+static process_t *free_nodes = NULL;
+static int live_nodes = 0;
+
+/* hashes a pid to a slot of an index with 'capacity' slots.
+ * Fibonacci hashing spreads the sequential pids the kernel hands out
+ * across the table instead of clustering them.
+ */
+static inline unsigned int hash_pid(pid_t pid, int capacity) {
+  return ((unsigned int)pid * 2654435769u) & (capacity - 1);
+}
+
+/* allocates an empty pid index with 'capacity' slots */
+static pindex_slot *alloc_index(int capacity) {
+  pindex_slot *index = (pindex_slot *)calloc(capacity, sizeof(pindex_slot));
+  if (index == NULL) {
+    fprintf(stderr, "Error: calloc failed in alloc_index");
+    exit(1);
+  }
+  return index;
+}
+
+/* returns the slot holding pid, or the empty slot where it would go */
+static pindex_slot *find_slot(plist_t *proc_list, pid_t pid) {
+  int mask = proc_list->capacity - 1;
+  unsigned int i = hash_pid(pid, proc_list->capacity);
+  while (proc_list->index[i].node != NULL && proc_list->index[i].pid != pid)
+    i = (i + 1) & mask;
+  return &proc_list->index[i];
+}
+
+/* doubles the capacity of the pid index and rehashes every node */
+static void grow_index(plist_t *proc_list) {
+  pindex_slot *old = proc_list->index;
+  int old_capacity = proc_list->capacity;
+  proc_list->capacity *= 2;
+  proc_list->index = alloc_index(proc_list->capacity);
+  for (int i = 0; i < old_capacity; i++) {
+    if (old[i].node != NULL)
+      *find_slot(proc_list, old[i].pid) = old[i];
+  }
+  free(old);
+}
+
+/* adds pid to the index, or points it at node if it is already there */
+static void index_insert(plist_t *proc_list, pid_t pid, process_t *node) {
+  // keep the index at most half full so probe sequences stay short.
+  if (2 * (proc_list->used + 1) > proc_list->capacity)
+    grow_index(proc_list);
+  pindex_slot *slot = find_slot(proc_list, pid);
+  if (slot->node == NULL)
+    proc_list->used++;
+  slot->pid = pid;
+  slot->node = node;
+}
+
+/* removes the index entry in 'slot', shifting back any entries after it
+ * in the same probe sequence so no tombstones are needed.
+ */
+static void index_remove(plist_t *proc_list, pindex_slot *slot) {
+  int mask = proc_list->capacity - 1;
+  unsigned int hole = slot - proc_list->index;
+  unsigned int i = (hole + 1) & mask;
+  while (proc_list->index[i].node != NULL) {
+    unsigned int home = hash_pid(proc_list->index[i].pid, proc_list->capacity);
+    // an entry can fill the hole only if the hole lies on its probe
+    // sequence, i.e. between its home slot and its current slot.
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      proc_list->index[hole] = proc_list->index[i];
+      hole = i;
+    }
+    i = (i + 1) & mask;
+  }
+  proc_list->index[hole].node = NULL;
+  proc_list->index[hole].pid = 0;
+  proc_list->used--;
+}
+
 /* Creates and allocates memory for a new linked list
  * inputs: none
  * returns: pointer to the new linked list with size 0 and a NULL head
  */
 plist_t *create_list() {
   plist_t *list = (plist_t *)malloc(sizeof(struct plist_t));
+  if (list == NULL) {
+    fprintf(stderr, "Error: malloc failed in create_list");
+    exit(1);
+  }
   list->size = 0;
   list->head = NULL;
   list->tail = NULL;
+  list->capacity = INITIAL_CAPACITY;
+  list->used = 0;
+  list->index = alloc_index(INITIAL_CAPACITY);
   return list;
 }
 
-/* Creates and allocates memory for a new node
+/* takes a record from the free list, adding a slab if it is empty */
+static process_t *alloc_node() {
+  if (free_nodes == NULL) {
+    slab_t *slab = malloc(sizeof(slab_t));
+    if (slab == NULL) {
+      fprintf(stderr, "Error: malloc failed in alloc_node");
+      exit(1);
+    }
+    slab->next = slabs;
+    slabs = slab;
+    // pushed in reverse so records are handed out in address order
+    for (int i = NODES_PER_SLAB - 1; i >= 0; i--) {
+      slab->nodes[i].next = free_nodes;
+      free_nodes = &slab->nodes[i];
+    }
+  }
+  process_t *node = free_nodes;
+  free_nodes = node->next;
+  live_nodes++;
+  return node;
+}
+
+/* Creates a new node
  * inputs: pid - pointer to the process id to be stored in the node
+ *         name - command of the process, interned
  * returns: a process_t instance that points to pid and a NULL next node
  */
-process_t *new_node(int pid, char name[LINE_MAX], enum pstate state) {
-  process_t *node = (process_t *)malloc(sizeof(struct process_t));
-  if (node == NULL) {
-    fprintf(stderr, "Error: malloc failed in new_node");
-    exit(1);
-  }
+process_t *new_node(int pid, const char *name, enum pstate state) {
+  process_t *node = alloc_node();
   node->pid = pid;
   node->state = state;
-  strncpy(node->name, name, LINE_MAX);
+  node->name = intern(name);
   node->next = NULL;
+  node->prev = NULL;
+  node->stats = NULL;
+  node->cpu = -1;
+  node->node = -1;
+  node->pgid = 0;
+  node->grouped = 0;
+  node->stages = NULL;
+  node->nstages = 1;
+  node->alive = 1;
+  node->status = 0;
+  node->start_ns = 0;
+  node->slot = -1;
+  node->pidfd = -1;
+  node->batch_index = 0;
+  node->batch_left = 0;
+  node->admit_held = 0;
+  node->map = 0;
+  node->usage = NULL;
   return node;
 }
 
+/* frees a node and anything it owns, returning it to the free list */
+static void free_node(process_t *node) {
+  release_stats(node->stats);
+  free(node->stages);
+  free(node->usage);
+  intern_release(node->name);
+  node->next = free_nodes;
+  free_nodes = node;
+  live_nodes--;
+}
+
 /* Adds a new node to the end of the linked list.
  * Expects a non-NULL list, i.e one created with create_list
  * List tracks tail pointer to make this operation O(1).
@@ -45,7 +194,11 @@ process_t *new_node(int pid, char name[LINE_MAX], enum pstate state) {
  * returns: pointer to the head of the updated list
  */
 plist_t *add_at_end(plist_t *proc_list, process_t *p_new) {
+  index_insert(proc_list, p_new->pid, p_new);
+
   proc_list->size++;
+  p_new->next = NULL;
+  p_new->prev = proc_list->tail;
   if (proc_list->head == NULL) {
     proc_list->head = p_new;
     proc_list->tail = p_new;
@@ -57,38 +210,69 @@ plist_t *add_at_end(plist_t *proc_list, process_t *p_new) {
   return proc_list;
 }
 
-/* Removes a node from the linked list by its process id
+/* Makes a node also reachable by another pid, e.g. the later stages of a
+ * pipeline, without adding it to the list again.
+ * inputs: proc_list - pointer to the linked list
+ *         pid - the additional process id
+ *         node - node already in the list
+ */
+void add_alias(plist_t *proc_list, int pid, process_t *node) {
+  index_insert(proc_list, pid, node);
+}
+
+/* Lists a node under another of its pids, e.g. a later stage of a
+ * pipeline once the first one was reaped, so the reaped pid can be reused
+ * by a new process without colliding with it. The node's samples were of
+ * the old pid, so they are dropped.
+ * inputs: proc_list - pointer to the linked list
+ *         node - node already in the list
+ *         pid - the pid it's listed under from now on
+ */
+void rekey_node(plist_t *proc_list, process_t *node, int pid) {
+  pindex_slot *slot = find_slot(proc_list, node->pid);
+  if (slot->node == node)
+    index_remove(proc_list, slot);
+  index_insert(proc_list, pid, node);
+  node->pid = pid;
+  release_stats(node->stats);
+  node->stats = NULL;
+}
+
+/* Removes a pid added by add_alias, the node stays in the list */
+void remove_alias(plist_t *proc_list, int pid) {
+  pindex_slot *slot = find_slot(proc_list, pid);
+  if (slot->node != NULL && slot->node->pid != pid)
+    index_remove(proc_list, slot);
+}
+
+/* Removes a node from the linked list by its process id, or the pid of any
+ * of its pipeline stages. The node is found through the pid index, and
+ * unlinked using its prev pointer, so this is O(1) on average.
  * inputs: proc_list - pointer to the linked list
  *         pid - the process id to be removed
  * returns: the updated list
  */
 plist_t *remove_by_pid(plist_t *proc_list, int pid) {
-  // update the list's head if the head is to be removed
-  if (proc_list->head != NULL && proc_list->head->pid == pid) {
-    process_t *next = proc_list->head->next;
-    free(proc_list->head);
-    proc_list->head = next;
-    proc_list->size--;
+  process_t *node = find_slot(proc_list, pid)->node;
+  if (node == NULL)
     return proc_list;
-  }
-  // otherwise, search the list until pid is found and remove it.
-  else {
-    process_t *cur = proc_list->head;
-    while (cur->next != NULL) {
-      if (cur->next->pid == pid) {
-        process_t *next = cur->next->next;
-        free(cur->next);
-        cur->next = next;
-        // critical to update the tail pointer if the tail is removed,
-        // otherwise anything added to the end will be lost.
-        if (cur->next == NULL)
-          proc_list->tail = cur;
-        proc_list->size--;
-        return proc_list;
-      }
-      cur = cur->next;
-    }
-  }
+  index_remove(proc_list, find_slot(proc_list, node->pid));
+  for (int i = 0; node->stages != NULL && i < node->nstages; i++)
+    remove_alias(proc_list, node->stages[i]);
+
+  if (node->prev != NULL)
+    node->prev->next = node->next;
+  else
+    proc_list->head = node->next;
+  // critical to update the tail pointer if the tail is removed,
+  // otherwise anything added to the end will be lost.
+  if (node->next != NULL)
+    node->next->prev = node->prev;
+  else
+    proc_list->tail = node->prev;
+
+  free_node(node);
+  proc_list->size--;
   return proc_list;
 }
 
@@ -98,21 +282,77 @@ plist_t *remove_by_pid(plist_t *proc_list, int pid) {
  * returns: 1 if the process id is in the list, 0 otherwise
  */
 int contains_pid(plist_t *proc_list, int pid) {
-  process_t *cur = proc_list->head;
-  while (cur != NULL) {
-    if (cur->pid == pid)
-      return 1;
-    cur = cur->next;
-  }
-  return 0;
+  return find_slot(proc_list, pid)->node != NULL;
 }
 
+/* Looks up a process by its process id
+ * inputs: proc_list - pointer to the linked list
+ *         pid - the process id to look up
+ * returns: the process with the given pid, NULL if it isn't in the list
+ */
 process_t *get_process(plist_t *proc_list, int pid) {
-  process_t *cur = proc_list->head;
-  while (cur != NULL) {
-    if (cur->pid == pid)
-      return cur;
-    cur = cur->next;
+  return find_slot(proc_list, pid)->node;
+}
+
+/* Checks the invariants of a list: size is the number of nodes linked from
+ * head, every prev pointer matches, tail is the last node, every node (and
+ * every stage of a pipeline) is found in the pid index, and the index holds
+ * exactly those pids. Walks the whole list, it's meant for debugging and
+ * stress testing (see PMAN_CHECK).
+ * inputs: proc_list - pointer to the linked list
+ * returns: NULL if the list is consistent, a description of the first
+ *          broken invariant otherwise
+ */
+const char *plist_check(plist_t *proc_list) {
+  static char error[128];
+  int count = 0, aliases = 0, occupied = 0;
+  process_t *prev = NULL;
+  for (process_t *cur = proc_list->head; cur != NULL; cur = cur->next) {
+    if (cur->prev != prev) {
+      snprintf(error, sizeof(error), "prev of %d doesn't point at %d",
+               cur->pid, prev != NULL ? prev->pid : 0);
+      return error;
+    }
+    if (get_process(proc_list, cur->pid) != cur) {
+      snprintf(error, sizeof(error), "%d isn't in the pid index", cur->pid);
+      return error;
+    }
+    for (int i = 0; cur->stages != NULL && i < cur->nstages; i++) {
+      if (cur->stages[i] == 0 || cur->stages[i] == cur->pid)
+        continue;
+      // reaped stages are removed from the index, the others point at cur
+      process_t *stage = get_process(proc_list, cur->stages[i]);
+      if (stage != NULL && stage != cur) {
+        snprintf(error, sizeof(error), "stage %d of %d indexes another node",
+                 cur->stages[i], cur->pid);
+        return error;
+      }
+      aliases += stage != NULL;
+    }
+    prev = cur;
+    // a cycle would make the walk endless, stop once it's past size
+    if (++count > proc_list->size)
+      break;
+  }
+  if (count != proc_list->size) {
+    snprintf(error, sizeof(error), "size is %d but %s%d nodes are linked",
+             proc_list->size, count > proc_list->size ? "over " : "",
+             count);
+    return error;
+  }
+  if (proc_list->tail != prev) {
+    snprintf(error, sizeof(error), "tail is %d instead of %d",
+             proc_list->tail != NULL ? proc_list->tail->pid : 0,
+             prev != NULL ? prev->pid : 0);
+    return error;
+  }
+  for (int i = 0; i < proc_list->capacity; i++)
+    occupied += proc_list->index[i].node != NULL;
+  if (occupied != proc_list->used || occupied != count + aliases) {
+    snprintf(error, sizeof(error),
+             "pid index has %d entries, used is %d, expected %d", occupied,
+             proc_list->used, count + aliases);
+    return error;
   }
   return NULL;
 }
@@ -124,8 +364,19 @@ void free_list(plist_t *proc_list) {
   process_t *cur = proc_list->head;
   while (cur != NULL) {
     process_t *next = cur->next;
-    free(cur);
+    free_node(cur);
     cur = next;
   }
+  free(proc_list->index);
   free(proc_list);
+  // the slabs (and strings) are freed once every list is
+  if (live_nodes == 0) {
+    while (slabs != NULL) {
+      slab_t *next = slabs->next;
+      free(slabs);
+      slabs = next;
+    }
+    free_nodes = NULL;
+    intern_cleanup();
+  }
 }
@@ -3,40 +3,101 @@
  */
 
 #include <limits.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 
 #ifndef _LINKEDLIST_H_
 #define _LINKEDLIST_H_
 
-enum pstate { ACTIVE, STOPPED };
+// QUEUED processes are waiting in the bgqueue and haven't been started yet
+enum pstate { ACTIVE, STOPPED, QUEUED };
 
 // node of the list, describes a process with
 // pid, the current state, (active or stopped) and
 // the name, which is the command entered into pman to
-// start the process.
+// start the process. Nodes are allocated from slabs, and the fields
+// walking the list and printing it touch come first.
 typedef struct process_t {
+  struct process_t *next;
+  struct process_t *prev;
   pid_t pid;
   enum pstate state;
-  char name[LINE_MAX];
-  struct process_t *next;
+  // interned, shared by every process started with the same command
+  const char *name;
+  // cpu or NUMA node the process is pinned to, -1 if it isn't
+  int cpu;
+  int node;
+  // process group signals are sent to, 0 to signal just pid
+  pid_t pgid;
+  // 1 if the process is in the process group PMan starts background
+  // processes in, which is signalled as a whole by the bulk commands
+  int grouped;
+  // /proc sampling state, NULL until the process is first sampled
+  struct job_stats *stats;
+  // pids of every stage of a pipeline, NULL for single processes.
+  // pid is the first stage, the other stages are aliases in the pid index.
+  pid_t *stages;
+  int nstages;
+  // stages that haven't been reaped yet
+  int alive;
+  // wait status of the process, or the last stage of a pipeline
+  int status;
+  // slot of the process in the job table, -1 if it has none
+  int slot;
+  // CLOCK_BOOTTIME when the process was started, in ns
+  long long start_ns;
+  // pidfd a process re-adopted from a previous PMan is watched through,
+  // -1 for PMan's own children
+  int pidfd;
+  // for a bgn batch waiting in the bgqueue, the PMAN_INDEX of its next
+  // instance and how many instances are left, 0 for other queued commands
+  int batch_index;
+  int batch_left;
+  // 1 for a queued command held by admission control rather than pushed
+  // with bgqueue, which isn't limited by max_running once admitted
+  int admit_held;
+  // id of the bgmap that started the process, 0 if it wasn't
+  int map;
+  // resource usage of the stages of a pipeline reaped so far, NULL until
+  // the first one is
+  struct rusage *usage;
 
 } process_t;
 
+// slot of the pid index. The pid is stored next to the node
+// so probing doesn't have to dereference every node it passes.
+typedef struct pindex_slot {
+  pid_t pid;
+  process_t *node;
+
+} pindex_slot;
+
 // list struct, holds the head of a list and the number of
-// elements in the list.
+// elements in the list. Nodes are linked in insertion order,
+// and additionally indexed by pid in an open addressing hash table
+// (linear probing, capacity is always a power of two) so lookups by
+// pid don't need to walk the list.
 typedef struct plist_t {
   int size;
   process_t *head;
   process_t *tail;
+  pindex_slot *index;
+  int capacity;
+  // occupied slots of the index, more than size if there are aliases
+  int used;
 
 } plist_t;
 
 plist_t *create_list();
-process_t *new_node(int pid, char name[LINE_MAX], enum pstate state);
+process_t *new_node(int pid, const char *name, enum pstate state);
 plist_t *add_at_end(plist_t *proc_list, process_t *pnew);
 plist_t *remove_by_pid(plist_t *proc_list, int pid);
+void add_alias(plist_t *proc_list, int pid, process_t *node);
+void remove_alias(plist_t *proc_list, int pid);
+void rekey_node(plist_t *proc_list, process_t *node, int pid);
 int contains_pid(plist_t *proc_list, int pid);
 process_t *get_process(plist_t *proc_list, int pid);
+const char *plist_check(plist_t *proc_list);
 void free_list(plist_t *proc_list);
 
 #endif
@@ -0,0 +1,181 @@
+/* @file metrics.c
+ * @brief Source file for PMan's runtime counters and latency histograms.
+ * Latencies are kept in log-linear histograms: every power of two is split
+ * into 16 linear buckets, so any value is recorded in constant time with
+ * about 6% precision, and percentiles are read without storing samples.
+ */
+
+#include "metrics.h"
+#include "event.h"
+#include "utils.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+// linear buckets per power of two, as a number of bits
+#define SUB_BITS 4
+#define SUB_BUCKETS (1 << SUB_BITS)
+// values up to 2^40 ns (about 18 minutes) get their own bucket
+#define MAX_EXP 40
+#define N_BUCKETS ((MAX_EXP - SUB_BITS + 2) * SUB_BUCKETS)
+
+typedef struct hist_t {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t buckets[N_BUCKETS];
+
+} hist_t;
+
+static uint64_t counters[M_NCOUNTERS];
+static hist_t hists[M_NHISTS];
+static long long start_ns = 0;
+
+static const char *counter_names[] = {"spawns", "exec_failures", "reaps",
+                                      "signals", "wakeups"};
+static const char *hist_names[] = {"spawn", "reap", "dispatch"};
+
+/* index of the bucket a value is recorded in. Values below SUB_BUCKETS
+ * have a bucket each, larger ones are grouped by their highest bit and
+ * the SUB_BITS bits below it.
+ */
+static int bucket_of(uint64_t v) {
+  if (v < SUB_BUCKETS)
+    return v;
+  int exp = 63 - __builtin_clzll(v);
+  if (exp > MAX_EXP)
+    return N_BUCKETS - 1;
+  int sub = (v >> (exp - SUB_BITS)) & (SUB_BUCKETS - 1);
+  return (exp - SUB_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+/* highest value that is recorded in a bucket */
+static uint64_t bucket_max(int i) {
+  if (i < SUB_BUCKETS)
+    return i;
+  int exp = i / SUB_BUCKETS + SUB_BITS - 1, sub = i % SUB_BUCKETS;
+  uint64_t width = 1ULL << (exp - SUB_BITS);
+  return (1ULL << exp) + (sub + 1) * width - 1;
+}
+
+/* value below which p percent of the recorded values are */
+static uint64_t hist_percentile(hist_t *hist, double p) {
+  if (hist->count == 0)
+    return 0;
+  uint64_t rank = hist->count * p / 100, seen = 0;
+  if (rank == 0)
+    rank = 1;
+  for (int i = 0; i < N_BUCKETS; i++) {
+    seen += hist->buckets[i];
+    if (seen >= rank)
+      return bucket_max(i) < hist->max ? bucket_max(i) : hist->max;
+  }
+  return hist->max;
+}
+
+/* records PMan's start time, rates are computed from it */
+void metrics_init() { start_ns = monotonic_ns(); }
+
+/* increments a counter */
+void metric_inc(enum counter counter) { counters[counter]++; }
+
+/* records a latency, in nanoseconds, in a histogram */
+void metric_record(enum histogram hist, long long ns) {
+  if (ns < 0)
+    return;
+  hist_t *h = &hists[hist];
+  h->count++;
+  h->sum += ns;
+  if ((uint64_t)ns > h->max)
+    h->max = ns;
+  h->buckets[bucket_of(ns)]++;
+}
+
+/* prints the counters, and the count and percentiles of every histogram
+ * in microseconds, for the pmstats command.
+ */
+void print_metrics() {
+  strbuf_t out;
+  sb_init(&out);
+  double uptime = start_ns ? (monotonic_ns() - start_ns) / 1e9 : 0;
+  for (int i = 0; i < M_NCOUNTERS; i++)
+    sb_printf(&out, "%-14s %10lu\n", counter_names[i],
+              (unsigned long)counters[i]);
+  if (uptime > 0)
+    sb_printf(&out, "%-14s %10.1f/s\n", "wakeup rate",
+              counters[M_WAKEUPS] / uptime);
+  sb_printf(&out, "\n%-10s %8s %10s %10s %10s %10s %10s\n", "LATENCY", "COUNT",
+            "MEAN(us)", "P50(us)", "P90(us)", "P99(us)", "MAX(us)");
+  for (int i = 0; i < M_NHISTS; i++) {
+    hist_t *h = &hists[i];
+    sb_printf(&out, "%-10s %8lu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+              hist_names[i], (unsigned long)h->count,
+              h->count ? h->sum / 1e3 / h->count : 0.0,
+              hist_percentile(h, 50) / 1e3, hist_percentile(h, 90) / 1e3,
+              hist_percentile(h, 99) / 1e3, h->max / 1e3);
+  }
+  fwrite(out.data, 1, out.len, stdout);
+  sb_free(&out);
+}
+
+/* renders every counter and histogram summary as a JSON object, with
+ * latencies in nanoseconds.
+ */
+void metrics_json(strbuf_t *out) {
+  sb_printf(out, "{\"uptime_ns\": %lld",
+            start_ns ? monotonic_ns() - start_ns : 0);
+  for (int i = 0; i < M_NCOUNTERS; i++)
+    sb_printf(out, ", \"%s\": %lu", counter_names[i],
+              (unsigned long)counters[i]);
+  for (int i = 0; i < M_NHISTS; i++) {
+    hist_t *h = &hists[i];
+    sb_printf(out,
+              ", \"%s\": {\"count\": %lu, \"sum\": %lu, \"p50\": %lu, "
+              "\"p90\": %lu, \"p99\": %lu, \"max\": %lu}",
+              hist_names[i], (unsigned long)h->count, (unsigned long)h->sum,
+              (unsigned long)hist_percentile(h, 50),
+              (unsigned long)hist_percentile(h, 90),
+              (unsigned long)hist_percentile(h, 99), (unsigned long)h->max);
+  }
+  sb_printf(out, "}\n");
+}
+
+/* Writes the metrics as JSON to path. The file is replaced atomically, so
+ * readers never see a partly written dump.
+ * returns: 0 on success, -1 on failure
+ */
+int metrics_dump(const char *path) {
+  char tmp[PATH_MAX];
+  if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+    return -1;
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1)
+    return -1;
+  strbuf_t out;
+  sb_init(&out);
+  metrics_json(&out);
+  int ok = write(fd, out.data, out.len) == (ssize_t)out.len;
+  sb_free(&out);
+  close(fd);
+  if (!ok || rename(tmp, path) == -1) {
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+/* timer handler, dumps the metrics to the file given to metrics_start */
+static int dump_metrics(int fd, uint32_t events, void *data) {
+  metrics_dump(data);
+  return 0;
+}
+
+/* Starts dumping the metrics to path every interval_ms milliseconds.
+ * returns: 0 on success, -1 if the timer couldn't be created
+ */
+int metrics_start(const char *path, int interval_ms) {
+  return ev_timer(interval_ms, dump_metrics, (void *)path) == -1 ? -1 : 0;
+}
@@ -0,0 +1,36 @@
+/* @file metrics.h
+ * @brief Header file for PMan's runtime counters and latency histograms
+ */
+
+#include "utils.h"
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+// counters of events in PMan's hot paths
+enum counter {
+  M_SPAWNS,     // processes started
+  M_EXEC_FAILS, // commands that couldn't be started
+  M_REAPS,      // children reaped
+  M_SIGNALS,    // signals sent to background processes
+  M_WAKEUPS,    // times the event loop woke up
+  M_NCOUNTERS
+};
+
+// latencies recorded in histograms, in nanoseconds
+enum histogram {
+  H_SPAWN,    // starting a process until its exec succeeded
+  H_REAP,     // event loop waking for SIGCHLD until the exit is handled
+  H_DISPATCH, // handling one command
+  M_NHISTS
+};
+
+void metrics_init();
+void metric_inc(enum counter counter);
+void metric_record(enum histogram hist, long long ns);
+void print_metrics();
+void metrics_json(strbuf_t *out);
+int metrics_dump(const char *path);
+int metrics_start(const char *path, int interval_ms);
+
+#endif
@@ -0,0 +1,338 @@
+/* @file pathcache.c
+ * @brief Source file for the cache of resolved executable paths. Commands
+ * are looked up in $PATH once, and then started from their absolute path
+ * with execve, so starting the same command again costs no stat calls in
+ * PMan or in the child. The $PATH directories (and the directories of
+ * commands given as a path) are watched with inotify, and the cache is
+ * cleared whenever anything in them changes, or watched again when one
+ * is deleted or moved. The inotify fd is checked before every lookup, so a
+ * stale path is never handed out.
+ */
+
+#define _GNU_SOURCE
+#include "pathcache.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// changes to a directory that can change what a command resolves to
+#define WATCH_EVENTS                                                           \
+  (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB |          \
+   IN_DELETE_SELF | IN_MOVE_SELF)
+// $PATH used when it isn't set, like execvp
+#define DEFAULT_PATH "/bin:/usr/bin"
+
+// a resolved command. path is NULL for commands that weren't found,
+// with err the reason, so invalid commands are cached as well.
+typedef struct path_entry {
+  char *name;
+  char *path;
+  int err;
+
+} path_entry;
+
+static path_entry *entries = NULL;
+static int capacity = 0;
+static int used = 0;
+// inotify fd, -1 before the first lookup. When inotify isn't available
+// nothing is cached.
+static int notify_fd = -1;
+static int caching = 0;
+// $PATH the cache was built for
+static char *cached_path = NULL;
+// index in $PATH of the first directory that doesn't exist (and so isn't
+// watched), -1 if they all exist. A command isn't found there now but may
+// be once the directory is created, so results that depend on it aren't
+// cached.
+static int first_missing = -1;
+// watch descriptors added, removed when $PATH changes
+static int *watches = NULL;
+static int n_watches = 0;
+static int max_watches = 0;
+
+/* FNV-1a hash of a command name */
+static uint32_t hash_name(const char *name) {
+  uint32_t h = 2166136261u;
+  for (; *name != '\0'; name++)
+    h = (h ^ (unsigned char)*name) * 16777619u;
+  return h;
+}
+
+/* finds the slot of name in the table, or the empty slot it belongs in */
+static path_entry *find_entry(const char *name) {
+  uint32_t mask = capacity - 1, i = hash_name(name) & mask;
+  while (entries[i].name != NULL && strcmp(entries[i].name, name) != 0)
+    i = (i + 1) & mask;
+  return &entries[i];
+}
+
+/* empties the cache, keeping the table's memory */
+void clear_path_cache() {
+  for (int i = 0; i < capacity; i++) {
+    free(entries[i].name);
+    free(entries[i].path);
+    entries[i].name = NULL;
+    entries[i].path = NULL;
+  }
+  used = 0;
+}
+
+/* doubles the table, rehashing every entry */
+static void grow_table() {
+  path_entry *old = entries;
+  int old_capacity = capacity;
+  capacity = capacity ? capacity * 2 : 64;
+  entries = calloc(capacity, sizeof(path_entry));
+  if (entries == NULL) {
+    fprintf(stderr, "Error: calloc failed in grow_table");
+    exit(1);
+  }
+  for (int i = 0; i < old_capacity; i++) {
+    if (old[i].name != NULL)
+      *find_entry(old[i].name) = old[i];
+  }
+  free(old);
+}
+
+/* checks if wd is one of the watches added since $PATH was last watched */
+static int is_watched(int wd) {
+  for (int i = 0; i < n_watches; i++) {
+    if (watches[i] == wd)
+      return 1;
+  }
+  return 0;
+}
+
+/* watches a directory for changes, returns -1 if it can't be watched */
+static int watch_dir(const char *dir) {
+  int wd = inotify_add_watch(notify_fd, dir[0] != '\0' ? dir : ".",
+                             WATCH_EVENTS | IN_ONLYDIR);
+  if (wd == -1)
+    return -1;
+  // a directory watched again gets the descriptor it already has
+  if (is_watched(wd))
+    return wd;
+  if (n_watches == max_watches) {
+    max_watches = max_watches ? max_watches * 2 : 16;
+    watches = realloc(watches, max_watches * sizeof(int));
+    if (watches == NULL) {
+      fprintf(stderr, "Error: realloc failed in watch_dir");
+      exit(1);
+    }
+  }
+  watches[n_watches++] = wd;
+  return wd;
+}
+
+/* stops watching every directory, so changes to directories no longer in
+ * $PATH don't keep clearing the cache
+ */
+static void unwatch_all() {
+  for (int i = 0; i < n_watches; i++)
+    inotify_rm_watch(notify_fd, watches[i]);
+  n_watches = 0;
+}
+
+/* Starts watching the directories of $PATH instead of the ones watched so
+ * far, after clearing the cache if $PATH changed. Entries are only cached
+ * while every directory of $PATH that exists is watched.
+ */
+static void watch_path(const char *path) {
+  clear_path_cache();
+  free(cached_path);
+  cached_path = strdup(path);
+  caching = notify_fd != -1 && cached_path != NULL;
+  first_missing = -1;
+  if (!caching)
+    return;
+  unwatch_all();
+  int i = 0;
+  for (const char *dir = path; dir != NULL; i++) {
+    const char *end = strchr(dir, ':');
+    char buf[PATH_MAX];
+    // an empty entry in $PATH means the current directory
+    snprintf(buf, sizeof(buf), "%.*s",
+             end != NULL ? (int)(end - dir) : (int)strlen(dir), dir);
+    if (watch_dir(buf) == -1) {
+      if (errno != ENOENT && errno != ENOTDIR)
+        caching = 0;
+      else if (first_missing == -1)
+        first_missing = i;
+    }
+    dir = end != NULL ? end + 1 : NULL;
+  }
+}
+
+/* Reads pending inotify events, clearing the cache if there were any. A
+ * watched directory that was deleted or moved loses its watch, so $PATH
+ * is watched again, which watches a directory recreated at its path (or
+ * treats it as missing until it is).
+ */
+static void check_changes() {
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  int changed = 0, lost_watch = 0;
+  ssize_t n;
+  while ((n = read(notify_fd, buf, sizeof(buf))) > 0) {
+    changed = 1;
+    for (char *p = buf; p < buf + n;) {
+      struct inotify_event *event = (struct inotify_event *)p;
+      // removed watches report IN_IGNORED too, only the current ones count
+      if ((event->mask & IN_Q_OVERFLOW) ||
+          ((event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) &&
+           is_watched(event->wd)))
+        lost_watch = 1;
+      p += sizeof(struct inotify_event) + event->len;
+    }
+  }
+  if (lost_watch) {
+    char *path = cached_path;
+    cached_path = NULL;
+    watch_path(path);
+    free(path);
+  } else if (changed) {
+    clear_path_cache();
+  }
+}
+
+/* checks if path is an executable regular file, like execve requires */
+static int is_executable(const char *path, int *err) {
+  struct stat sb;
+  if (stat(path, &sb) == -1) {
+    *err = errno;
+    return 0;
+  }
+  if (!S_ISREG(sb.st_mode) || access(path, X_OK) == -1) {
+    *err = EACCES;
+    return 0;
+  }
+  return 1;
+}
+
+/* Resolves a command the way execvp would, without the cache.
+ * inputs: dir_index - set to the index in $PATH of the directory the
+ *                     command was found in, or the number of directories
+ *                     if it wasn't found in any
+ * returns: the malloc'd absolute path of the executable, NULL if it wasn't
+ *          found, with the reason in err
+ */
+static char *search(const char *cmd, const char *path, int *err,
+                    int *dir_index) {
+  char full[PATH_MAX];
+  // commands given as a path aren't searched for
+  *dir_index = 0;
+  if (strchr(cmd, '/') != NULL) {
+    if (!is_executable(cmd, err))
+      return NULL;
+    if (realpath(cmd, full) == NULL) {
+      *err = errno;
+      return NULL;
+    }
+    return strdup(full);
+  }
+  // like execvp, EACCES is only reported if no directory had the command
+  int seen_eacces = 0;
+  *err = ENOENT;
+  *dir_index = 0;
+  for (const char *dir = path; dir != NULL; (*dir_index)++) {
+    const char *end = strchr(dir, ':');
+    int len = end != NULL ? end - dir : (int)strlen(dir);
+    // an empty entry in $PATH means the current directory
+    if (snprintf(full, sizeof(full), "%.*s%s%s", len, dir, len ? "/" : "",
+                 cmd) < (int)sizeof(full) &&
+        is_executable(full, err))
+      return strdup(full);
+    seen_eacces = seen_eacces || *err == EACCES;
+    dir = end != NULL ? end + 1 : NULL;
+  }
+  *err = seen_eacces ? EACCES : ENOENT;
+  return NULL;
+}
+
+/* Resolves the command a process is started with to the absolute path of
+ * its executable, searching $PATH for commands without a "/". Results are
+ * cached until something changes in the directories involved.
+ * returns: the absolute path, valid until the next call, or NULL if the
+ *          command can't be executed (errno is set)
+ */
+const char *resolve_command(const char *cmd) {
+  static char *uncached = NULL;
+  const char *path = getenv("PATH");
+  if (path == NULL)
+    path = DEFAULT_PATH;
+  if (notify_fd == -1 && cached_path == NULL)
+    notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (cached_path == NULL || strcmp(path, cached_path) != 0)
+    watch_path(path);
+
+  int err = 0, dir_index;
+  if (!caching) {
+    free(uncached);
+    uncached = search(cmd, path, &err, &dir_index);
+    errno = err;
+    return uncached;
+  }
+  check_changes();
+  if (capacity == 0 || used * 2 >= capacity)
+    grow_table();
+  path_entry *entry = find_entry(cmd);
+  if (entry->name != NULL) {
+    errno = entry->err;
+    return entry->path;
+  }
+
+  char *resolved = search(cmd, path, &err, &dir_index);
+  // a command found after (or not found because of) a directory of $PATH
+  // that doesn't exist yet could resolve differently once it's created
+  char *slash = strrchr(cmd, '/');
+  if (slash == NULL && first_missing != -1 && dir_index > first_missing) {
+    free(uncached);
+    uncached = resolved;
+    errno = err;
+    return uncached;
+  }
+  // a command given as a path is only cached if its directory is watched
+  if (slash != NULL) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%.*s", (int)(slash - cmd), cmd);
+    if (watch_dir(slash == cmd ? "/" : dir) == -1) {
+      free(uncached);
+      uncached = resolved;
+      errno = err;
+      return uncached;
+    }
+  }
+  entry->name = strdup(cmd);
+  if (entry->name == NULL) {
+    fprintf(stderr, "Error: strdup failed in resolve_command");
+    exit(1);
+  }
+  entry->path = resolved;
+  entry->err = err;
+  used++;
+  errno = err;
+  return resolved;
+}
+
+/* frees the cache and stops watching for changes */
+void free_path_cache() {
+  clear_path_cache();
+  free(entries);
+  free(cached_path);
+  entries = NULL;
+  cached_path = NULL;
+  capacity = 0;
+  caching = 0;
+  free(watches);
+  watches = NULL;
+  n_watches = 0;
+  max_watches = 0;
+  if (notify_fd != -1)
+    close(notify_fd);
+  notify_fd = -1;
+}
@@ -0,0 +1,12 @@
+/* @file pathcache.h
+ * @brief Header file for the cache of resolved executable paths
+ */
+
+#ifndef _PATHCACHE_H_
+#define _PATHCACHE_H_
+
+const char *resolve_command(const char *cmd);
+void clear_path_cache();
+void free_path_cache();
+
+#endif
@@ -1,23 +1,51 @@
+#define _GNU_SOURCE
+#include "admission.h"
+#include "affinity.h"
+#include "bgmap.h"
+#include "capture.h"
+#include "control.h"
+#include "event.h"
+#include "history.h"
+#include "jobqueue.h"
+#include "jobtable.h"
 #include "list.h"
+#include "metrics.h"
 #include "process.h"
+#include "reader.h"
+#include "sampool.h"
+#include "top.h"
 #include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
 #include <unistd.h>
 #include <wait.h>
 
 int MAX_ARGS = 100; // max amount of unique arguments to read
-int WAIT_TIME = 1;  // how often select should check for input, in seconds
 int CMD = 0;       // position of the command to handle by PMan in the args list
 int FIRST_ARG = 1; // position of the first argument in the args list
 
 // tracks the pid of whatever child is running in the foreground.
 static sig_atomic_t fg_pid = -1;
 
+// reads commands from stdin, or the file given with -f
+static linereader_t reader;
+// in batch mode (input from a file or pipe) no prompts are printed,
+// and PMan waits for its background processes once the input ends.
+static int batch = 0;
+static int input_closed = 0;
+// when the command being handled started, 0 once its latency is recorded
+static long long dispatch_start = 0;
+// 1 if the process lists are checked after every event, see PMAN_CHECK
+static int check_lists = 0;
+
 /* passes signal sent to parent to foreground child signified by fg_pid.
  * if fg_pid is -1, then there is no foreground child and parent should exit()
  * prevents ctrl-c from terminating PMan when a foreground processes is running.
@@ -25,16 +53,17 @@ static sig_atomic_t fg_pid = -1;
 void sig_handler(int sig) { (fg_pid != -1) ? kill(fg_pid, sig) : exit(0); }
 
 /* parses the input string into an array of commands/arguments
- * assumes input string uses spaces to separate commands/arguments
+ * assumes input string uses spaces or tabs to separate commands/arguments.
+ * At most MAX_ARGS - 1 arguments are parsed, the rest are ignored.
  * inputs: input - the input string
  *         args - the array of arguments
  */
 void parse_cmds(char *input, char *args[]) {
-  char *token = strtok(input, " ");
+  char *token = strtok(input, " \t");
   int i = 0;
-  while (token != NULL) {
+  while (token != NULL && i < MAX_ARGS - 1) {
     args[i++] = token;
-    token = strtok(NULL, " ");
+    token = strtok(NULL, " \t");
   }
   args[i] = NULL;
 }
@@ -62,6 +91,64 @@ int pid_from_args(char *args[]) {
   return pid;
 }
 
+/* Like pid_from_args, for the commands that also take a range of pids
+ * "first-last" or "all", see parse_target.
+ * returns: 0 if the target is valid, -1 otherwise.
+ */
+static int target_from_args(char *args[], pid_t *lo, pid_t *hi) {
+  if (args[FIRST_ARG] == NULL) {
+    printf("Error: Expected argument\n");
+    return -1;
+  } else if (args[FIRST_ARG + 1] != NULL) {
+    printf("Error: Too many arguments\n");
+    return -1;
+  } else if (parse_target(args[FIRST_ARG], lo, hi) == -1) {
+    printf("Error: Invalid argument \"%s\", expected process id, range of "
+           "process ids or all\n",
+           args[FIRST_ARG]);
+    return -1;
+  }
+  return 0;
+}
+
+/* handles bgkill, bgstop and bgstart. A single pid is reported like
+ * before, a range or all with the number of processes signalled.
+ */
+static void signal_cmd(char *args[], plist_t *processes, int sig) {
+  pid_t lo, hi;
+  if (target_from_args(args, &lo, &hi) == -1)
+    return;
+  if (lo == hi)
+    send_signal(processes, lo, sig);
+  else
+    send_signal_range(processes, lo, hi, sig);
+}
+
+/* starts a background process, or holds it in the bgqueue while admission
+ * control holds new background processes, saying why.
+ */
+static void hold_or_fork(char *args[], plist_t *processes) {
+  const char *held = admit_check();
+  if (held == NULL) {
+    fork_process(args, processes, BG);
+    return;
+  }
+  char name[LINE_MAX];
+  name[0] = '\0';
+  concat_strs(name, args, LINE_MAX);
+  queue_hold(args);
+  printf("Held \"%s\" in the queue (%d queued): %s\n", name,
+         queued_jobs()->size, held);
+  queue_run(processes);
+}
+
+/* records how long the command being handled took, once */
+static void end_dispatch() {
+  if (dispatch_start != 0)
+    metric_record(H_DISPATCH, monotonic_ns() - dispatch_start);
+  dispatch_start = 0;
+}
+
 /* handles the commands that PMan can execute, and calls the appropriate
  * functions to handle them. Determines the requested command by parsing
  * the first element of args[].
@@ -76,28 +163,193 @@ int handle_cmds(char *args[], plist_t *processes) {
       // remove the "bg" command from args. Everything after are
       // the command/arguments for the child process to execute.
       remove_first(args);
-      fork_process(args, processes, BG);
+      hold_or_fork(args, processes);
+    }
+
+  } else if (strcmp(cmd, "bgn") == 0) {
+    int count = args[FIRST_ARG] != NULL ? atoi(args[FIRST_ARG]) : 0;
+    if (count <= 0) {
+      printf("Error: Expected instance count\n");
+    } else if (args[FIRST_ARG + 1] == NULL) {
+      printf("Error: Expected arguments\n");
+    } else {
+      // everything after the count is the command to start.
+      fork_batch(&args[FIRST_ARG + 1], count, processes);
+    }
+
+  } else if (strcmp(cmd, "bgqueue") == 0) {
+    // bgqueue [-j max] [args], -j sets how many background processes
+    // may run before commands wait in the queue.
+    int i = FIRST_ARG;
+    if (args[i] != NULL && strcmp(args[i], "-j") == 0) {
+      if (args[i + 1] == NULL || atoi(args[i + 1]) <= 0) {
+        printf("Error: Expected max running processes after -j\n");
+        return 1;
+      }
+      set_max_running(atoi(args[i + 1]));
+      i += 2;
+    } else if (args[i] == NULL) {
+      printf("Error: Expected arguments\n");
+      return 1;
+    }
+    if (args[i] != NULL) {
+      queue_push(&args[i]);
+      queue_run(processes);
+    }
+
+  } else if (strcmp(cmd, "bgmap") == 0) {
+    // bgmap [-j max] template... < file, or bgmap -c id to stop one.
+    // without arguments, prints the progress of every bgmap.
+    if (args[FIRST_ARG] == NULL) {
+      list_maps();
+    } else if (strcmp(args[FIRST_ARG], "-c") == 0) {
+      if (args[FIRST_ARG + 1] == NULL ||
+          map_cancel(atoi(args[FIRST_ARG + 1])) == -1)
+        printf("Error: Expected the id of a running bgmap after -c\n");
+      else
+        map_run(processes);
+    } else {
+      map_start(&args[FIRST_ARG], processes);
     }
 
   } else if (strcmp(cmd, "bglist") == 0) {
-    args[FIRST_ARG] != NULL ? printf("Error: Unexpected argument(s)\n")
-                            : list_processes(processes);
+    // bglist [-s state] [-m text] [-o order] [-n count] [-p page] [--json]
+    list_opts opts;
+    init_list_opts(&opts);
+    const char *error = parse_list_opts(&args[FIRST_ARG], &opts);
+    if (error != NULL) {
+      printf("Error: %s\n", error);
+    } else {
+      list_processes(processes, &opts);
+      // the queue is only listed along with every process
+      if (args[FIRST_ARG] == NULL)
+        list_queue(queued_jobs(), get_max_running());
+    }
+
+  } else if (strcmp(cmd, "bghist") == 0) {
+    // bghist [-m text] [-o end|wall|cpu|rss|faults] [-n count] [--json]
+    hist_opts opts;
+    init_hist_opts(&opts);
+    const char *error = parse_hist_opts(&args[FIRST_ARG], &opts);
+    if (error != NULL)
+      printf("Error: %s\n", error);
+    else
+      print_history(&opts);
+
+  } else if (strcmp(cmd, "bglog") == 0) {
+    // bglog pid [-f]
+    int follow = 0, pid = -1;
+    for (int i = FIRST_ARG; args[i] != NULL; i++) {
+      if (strcmp(args[i], "-f") == 0)
+        follow = 1;
+      else
+        pid = atoi(args[i]);
+    }
+    if (pid <= 0) {
+      printf("Error: Expected process id\n");
+    } else if (print_log(pid, follow) == -1) {
+      printf("Error: No output was captured for process %d\n", pid);
+    } else if (log_following()) {
+      // no prompt while following, see check_input.
+      return 0;
+    }
+
+  } else if (strcmp(cmd, "bgtop") == 0) {
+    // bgtop [cpu|rss|csw] [interval in ms], arguments in any order
+    enum top_sort sort = SORT_CPU;
+    int interval = 1000, valid = 1;
+    for (int i = FIRST_ARG; valid && args[i] != NULL; i++) {
+      if (strcmp(args[i], "cpu") == 0) {
+        sort = SORT_CPU;
+      } else if (strcmp(args[i], "rss") == 0) {
+        sort = SORT_RSS;
+      } else if (strcmp(args[i], "csw") == 0) {
+        sort = SORT_CSW;
+      } else if (atoi(args[i]) > 0) {
+        interval = atoi(args[i]);
+      } else {
+        printf("Error: Invalid argument \"%s\", expected cpu, rss, csw "
+               "or an interval in ms\n",
+               args[i]);
+        valid = 0;
+      }
+    }
+    if (valid && top_start(processes, sort, interval) == -1)
+      perror("bgtop");
+    // no prompt while bgtop is drawing, see check_input.
+    return top_active() ? 0 : 1;
+
+  } else if (strcmp(cmd, "bgplace") == 0) {
+    // without an argument, prints the current placement policy.
+    enum place_policy policy;
+    if (args[FIRST_ARG] == NULL) {
+      printf("Placement policy: %s\n", placement_name(get_placement()));
+    } else if (args[FIRST_ARG + 1] != NULL) {
+      printf("Error: Too many arguments\n");
+    } else if (parse_placement(args[FIRST_ARG], &policy) == -1) {
+      printf("Error: Invalid placement \"%s\", expected none, rr, least or "
+             "numa\n",
+             args[FIRST_ARG]);
+    } else {
+      set_placement(policy);
+    }
+
+  } else if (strcmp(cmd, "bgadmit") == 0) {
+    // bgadmit [cpu|memory|io|memavail value]..., without arguments prints
+    // the thresholds and current readings.
+    for (int i = FIRST_ARG; args[i] != NULL; i += 2) {
+      if (args[i + 1] == NULL || admit_set(args[i], args[i + 1]) == -1) {
+        printf("Error: Invalid threshold \"%s\", expected cpu, memory or io "
+               "and a pressure in percent, or memavail and a size in MB\n",
+               args[i]);
+        return 1;
+      }
+    }
+    if (args[FIRST_ARG] == NULL)
+      print_admission();
+    // jobs held under the old thresholds may be admitted now
+    queue_run(processes);
 
   } else if (strcmp(cmd, "bgkill") == 0) {
-    // if the pid is invalid, pid_from_args will print an error message,
-    // and return -1. send_signal just returns immediately in this case.
-    send_signal(processes, pid_from_args(args), SIGKILL);
+    signal_cmd(args, processes, SIGKILL);
 
   } else if (strcmp(cmd, "bgstop") == 0) {
-    send_signal(processes, pid_from_args(args), SIGSTOP);
+    signal_cmd(args, processes, SIGSTOP);
 
   } else if (strcmp(cmd, "bgstart") == 0) {
-    send_signal(processes, pid_from_args(args), SIGCONT);
+    signal_cmd(args, processes, SIGCONT);
+
+  } else if (strcmp(cmd, "bgterm") == 0) {
+    // SIGTERM, then SIGKILL for whatever is left after the grace period.
+    pid_t lo, hi;
+    int killed;
+    if (target_from_args(args, &lo, &hi) == 0) {
+      int done = terminate_range(processes, lo, hi, &killed);
+      if (done == 0 && lo == hi)
+        printf("Error: Process \"%d\" doesn't exist or was not started by "
+               "PMan\n",
+               lo);
+      else
+        printf("Terminated %d process%s, %d killed after the grace period\n",
+               done, done == 1 ? "" : "es", killed);
+    }
 
   } else if (strcmp(cmd, "pstat") == 0) {
-    int pid = pid_from_args(args);
-    if (pid != -1)
-      print_pstats(pid);
+    // without a pid, samples all background processes.
+    if (args[FIRST_ARG] == NULL) {
+      print_all_pstats(processes);
+    } else {
+      int pid = pid_from_args(args);
+      if (pid != -1)
+        print_pstats(pid);
+    }
+
+  } else if (strcmp(cmd, "pmstats") == 0) {
+    // pmstats [file], with a file the metrics are written to it as JSON.
+    if (args[FIRST_ARG] == NULL)
+      print_metrics();
+    else if (metrics_dump(args[FIRST_ARG]) == -1)
+      perror(args[FIRST_ARG]);
 
   } else if (strcmp(cmd, "quit") == 0 || strcmp(cmd, "exit") == 0) {
     return -1;
@@ -109,95 +361,323 @@ int handle_cmds(char *args[], plist_t *processes) {
     int status;
     // while fg_pid is set, incoming SIGINTs will exit the child.
     fg_pid = fork_process(args, processes, FG);
-    waitpid(fg_pid, &status, 0);
+    // the time spent waiting for the foreground process isn't PMan's.
+    end_dispatch();
+    if (fg_pid > 0)
+      waitpid(fg_pid, &status, 0);
     // once child exits, reset fg_pid so SIGINTS will exit the parent.
     fg_pid = -1;
   }
   return 1;
 }
 
-/* uses select() to determine if input can be read from stdin
- * returns 1 if input can be read, 0 if not, and -1 if select()
- * fails.
+/* parses and handles a single line of input.
+ * outputs -1 if the line is quit or exit, 1 otherwise.
  */
-int is_input() {
-  struct timeval tv = {.tv_sec = WAIT_TIME, .tv_usec = 0};
-  fd_set readfds;
-  FD_ZERO(&readfds);
-  FD_SET(fileno(stdin), &readfds);
-  return select(fileno(stdin) + 1, &readfds, NULL, NULL, &tv);
-}
-
-/* when called, checks for user input. If input exists, it parses the
- * input and handles the parsed commands. outputs -1 if input is quit or
- * exit, 0 if no actions taken, 1 if actions were taken,
- * or terminates with an error if the input check fails */
-int check_input(plist_t *processes) {
-  char raw_input[LINE_MAX], input[LINE_MAX];
+static int handle_line(char *line, plist_t *processes) {
   char *args[MAX_ARGS];
-  int child_ended = 0;
+  // while bgtop is running or bglog is following, any input just exits it.
+  if (top_active() || log_following()) {
+    top_stop();
+    stop_following();
+    return 1;
+  }
+  if (strlen(line) >= LINE_MAX) {
+    printf("Error: Input longer than %d characters\n", LINE_MAX - 1);
+  } else if (!all_spaces(line)) {
+    // scripts can contain comments
+    if (batch && line[strspn(line, " \t")] == '#')
+      return 1;
+    dispatch_start = monotonic_ns();
+    parse_cmds(line, args);
+    int result = handle_cmds(args, processes);
+    end_dispatch();
+    return result;
+  } else if (!batch) {
+    printf("Error: Expected input\n");
+  }
+  return 1;
+}
 
-  switch (is_input()) {
-  case -1:
-    perror("select");
-    exit(1);
-  case 0:
-    // no input, nothing to do.
+/* event handler for stdin (or the -f file), called by the event loop when
+ * input can be read. Reads what is available and handles every complete
+ * line of it. outputs -1 if input is quit or exit or the input was closed,
+ * 1 if any lines were handled, 0 otherwise.
+ */
+static int check_input(int fd, uint32_t events, void *data) {
+  plist_t *processes = data;
+  int n = lr_fill(&reader);
+  if (n == -1 && errno == EAGAIN)
     return 0;
-  default:
-    // read from stdin, doesn't block. Reads at
-    // most the max line size defined by <limits.h>
 
-    read(fileno(stdin), raw_input, LINE_MAX);
+  int result = 0;
+  char *line;
+  while ((line = lr_next(&reader)) != NULL) {
+    if (handle_line(line, processes) == -1)
+      return -1;
+    result = 1;
+  }
+  if (n <= 0) {
+    // input was closed (ctrl-d), interactively the same as quit.
+    input_closed = 1;
+    return -1;
+  }
+  return result;
+}
 
-    // wipe input so previous input doesn't persist
-    // when blank input is submitted.
-    clean_buffer(input, LINE_MAX);
-    // parse the raw buffer, stripping tabs and newlines.
-    sscanf(raw_input, "%[^\t\n]", input);
+/* event handler for the SIGCHLD signalfd, called by the event loop as soon
+ * as a child changes state. Drains the pending signals and reaps whatever
+ * children have exited. outputs 1 if exit messages were printed, 0 otherwise.
+ */
+static int check_children(int fd, uint32_t events, void *data) {
+  struct signalfd_siginfo info;
+  // SIGCHLDs coalesce, so one read may stand for many exited children.
+  // check_processes reaps all of them regardless of how many were read.
+  while (read(fd, &info, sizeof(info)) == sizeof(info))
+    ;
+  int reaped = check_processes(data);
+  int started = queue_run(data);
+  // bgmaps replace their instances that were reaped
+  int mapped = map_run(data);
+  return started > 0 || mapped || reaped > 0;
+}
 
-    if (!all_spaces(input)) {
-      parse_cmds(input, args);
-      return handle_cmds(args, processes);
-    } else {
-      printf("Error: Expected input\n");
-    }
-    return 1;
+/* checks the invariants of the process list and the bgqueue (see
+ * plist_check), aborting with the broken one so a stress test stops right
+ * where the list went wrong.
+ */
+static void check_invariants(plist_t *processes) {
+  const char *error = plist_check(processes);
+  if (error == NULL)
+    error = plist_check(queued_jobs());
+  if (error != NULL) {
+    fprintf(stderr, "Error: process list invariant broken: %s\n", error);
+    abort();
   }
 }
 
+/* prints how to start PMan and exits */
+static void usage(char *name) {
+  fprintf(stderr, "Usage: %s [-i] [-f file] [-s socket]\n", name);
+  exit(1);
+}
+
 /*
  * main function for PMan. Initializes child processes list, links signal
  * handlers; handles the main loop of the program, printing input prompts,
- * checking for user input and whether children have terminated.
+ * and sleeping in the event loop until there is input or a child changes
+ * state.
+ * PMan reads commands from stdin, or the file given with -f. Unless -i
+ * forces interactive mode, input that isn't a terminal is run in batch mode.
  */
-int main() {
-  int quit = 0, need_prompt = 1;
+int main(int argc, char *argv[]) {
+  int quit = 0, need_prompt = 1, interactive = 0, opt;
+  int input_fd = fileno(stdin);
+  char *socket_path = getenv("PMAN_SOCKET");
+  while ((opt = getopt(argc, argv, "if:s:")) != -1) {
+    switch (opt) {
+    case 'i':
+      interactive = 1;
+      break;
+    case 'f':
+      input_fd = open(optarg, O_RDONLY | O_CLOEXEC);
+      if (input_fd == -1) {
+        perror(optarg);
+        exit(1);
+      }
+      break;
+    case 's':
+      socket_path = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  batch = !interactive && !isatty(input_fd);
+  if (batch) {
+    // nobody watches the output as it happens, so let stdio buffer it
+    // fully and print exit messages without terminal escapes.
+    setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+    set_plain_output(1);
+    need_prompt = 0;
+  }
+  lr_init(&reader, input_fd);
+  metrics_init();
   plist_t *processes = create_list();
 
   signal(SIGINT, sig_handler);
 
+  // the sampler keeps /proc files open for every background process,
+  // so allow as many open files as the hard limit permits.
+  struct rlimit lim;
+  if (getrlimit(RLIMIT_NOFILE, &lim) == 0) {
+    lim.rlim_cur = lim.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &lim);
+  }
+
+  enum place_policy policy;
+  char *place = getenv("PMAN_PLACEMENT");
+  if (place != NULL && parse_placement(place, &policy) == 0)
+    set_placement(policy);
+
+  // the spawn backend can be chosen at runtime to compare them under load.
+  char *spawn = getenv("PMAN_SPAWN");
+  if (spawn != NULL)
+    set_spawn_backend(strcmp(spawn, "fork") == 0 ? SPAWN_FORK : SPAWN_POSIX);
+
+  // how long bgterm and quit give processes after SIGTERM, in ms.
+  char *grace = getenv("PMAN_KILL_GRACE");
+  if (grace != NULL && atoi(grace) >= 0)
+    set_kill_grace(atoi(grace));
+
+  // how many threads sample /proc for large lists of background processes,
+  // 0 samples them on PMan's own thread.
+  char *threads = getenv("PMAN_SAMPLER_THREADS");
+  if (threads != NULL && atoi(threads) >= 0)
+    pool_set_threads(atoi(threads));
+
+  // how many completed background processes bghist keeps.
+  char *history = getenv("PMAN_HISTORY");
+  if (history != NULL && atoi(history) >= 0)
+    hist_set_size(atoi(history));
+
+  // PMAN_ADMIT holds new background processes while the host is short on
+  // resources, e.g. "memory=20,memavail=512", see bgadmit.
+  char *admit = getenv("PMAN_ADMIT");
+  if (admit != NULL && admit_parse(admit) == -1)
+    fprintf(stderr, "Warning: invalid PMAN_ADMIT \"%s\"\n", admit);
+
+  // PMAN_CHECK=1 walks the process lists after every event to check they
+  // are consistent, for stress testing (see make stress).
+  char *check = getenv("PMAN_CHECK");
+  check_lists = check != NULL && atoi(check) > 0;
+
+  // descendants orphaned by background processes are reparented to PMan
+  // rather than init, so they are reaped along with its own children.
+  prctl(PR_SET_CHILD_SUBREAPER, 1);
+
+  // SIGCHLD is blocked and read from a signalfd instead, so child exits
+  // wake the event loop immediately. fork_process unblocks it in children.
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &mask, NULL);
+  int sig_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+  if (sig_fd == -1 || ev_init() == -1 ||
+      ev_add(sig_fd, EPOLLIN, check_children, processes) == -1) {
+    perror("event loop");
+    exit(1);
+  }
+  // regular files can't be watched by epoll, they are always readable.
+  // in that case input is read between non blocking checks of the loop.
+  int poll_input = ev_add(input_fd, EPOLLIN, check_input, processes) == -1;
+  if (poll_input && errno != EPERM) {
+    perror("event loop");
+    exit(1);
+  }
+
+  // background processes are kept in a table that outlives PMan, so a new
+  // PMan re-adopts the ones still running. PMAN_JOBTABLE sets where it is,
+  // an empty PMAN_JOBTABLE disables it.
+  char *table = getenv("PMAN_JOBTABLE");
+  if (table == NULL)
+    table = (char *)jt_default_path();
+  if (table[0] != '\0') {
+    int adopted = jt_open(table, processes);
+    if (adopted == -1 && errno == EWOULDBLOCK)
+      fprintf(stderr, "Warning: job table %s is used by another PMan, "
+                      "background processes won't be kept\n",
+              table);
+    else if (adopted == -1 && (errno == EPERM || errno == EINVAL))
+      fprintf(stderr, "Warning: %s isn't %s, background processes won't "
+                      "be kept\n",
+              table, errno == EPERM ? "a regular file owned by you"
+                                    : "a PMan job table");
+    else if (adopted == -1)
+      perror(table);
+    else if (adopted > 0)
+      printf("Re-adopted %d background process%s\n", adopted,
+             adopted == 1 ? "" : "es");
+  }
+
+  // other programs can manage background processes through a unix socket,
+  // given with -s or PMAN_SOCKET, see control.c for the protocol.
+  if (socket_path != NULL && control_start(socket_path, processes) == -1) {
+    perror(socket_path);
+    exit(1);
+  }
+
+  // PMAN_STATS_FILE has the metrics (see pmstats) dumped to it as JSON
+  // every PMAN_STATS_INTERVAL ms (default 5000), and once more at exit.
+  char *stats_file = getenv("PMAN_STATS_FILE");
+  if (stats_file != NULL) {
+    char *interval = getenv("PMAN_STATS_INTERVAL");
+    int ms = interval != NULL && atoi(interval) > 0 ? atoi(interval) : 5000;
+    if (metrics_start(stats_file, ms) == -1)
+      perror("PMAN_STATS_FILE");
+  }
+
   // main event loop
   while (!quit) {
-    if (need_prompt) {
+    // the prompt waits until bgtop or bglog -f exit, so it isn't drawn
+    // in the middle of their output
+    if (need_prompt && !batch && !top_active() && !log_following()) {
       printf("PMan: > ");
       need_prompt = 0;
     }
     // flushing stdout here makes displaying output faster.
     fflush(stdout);
-    int is_input = check_input(processes);
-    if (is_input == -1) {
+    // sleeps until stdin or a child is ready. A new prompt is needed
+    // whenever input was handled or a termination message was printed.
+    int result;
+    if (poll_input) {
+      result = check_input(input_fd, EPOLLIN, processes);
+      if (result != -1)
+        result = ev_wait(0) == -1 ? -1 : result;
+    } else {
+      result = ev_wait(-1);
+    }
+
+    if (result == -1 && batch && input_closed) {
+      // the script has ended, stop reading and wait for the background
+      // processes (and queued jobs) it started to finish.
+      if (!poll_input)
+        ev_del(input_fd);
+      poll_input = 0;
+      input_closed = 0;
+      result = 0;
+    }
+    if (result == -1) {
       quit = 1;
     } else {
-      // check_input returns 1 whenever input was submitted
-      // in which case a new prompt is needed. Additionally,
-      // a new prompt is also needed whenever check_processes()
-      // returns 1 as well, which is when it prints a termination message.
-      need_prompt = is_input || check_processes(processes);
+      need_prompt = need_prompt || result;
     }
+    if (check_lists)
+      check_invariants(processes);
+    // with a control socket PMan keeps serving it after the input ends.
+    if (batch && reader.eof && !poll_input && !control_active() &&
+        processes->size == 0 && queued_jobs()->size == 0 && !maps_active())
+      quit = 1;
   }
-  kill_all(processes);
+  control_stop();
+  pool_stop();
+  int killed, terminated = kill_all(processes, &killed);
+  if (!batch && terminated)
+    printf("Terminated %d background process%s, %d killed after the grace "
+           "period\n",
+           terminated, terminated == 1 ? "" : "es", killed);
+  jt_close();
+  if (stats_file != NULL)
+    metrics_dump(stats_file);
+  free_maps();
+  hist_free();
   free_list(processes);
-  printf("Exiting...\n");
+  free_queue();
+  admit_close();
+  capture_cleanup();
+  lr_free(&reader);
+  if (!batch)
+    printf("Exiting...\n");
   exit(0);
 }
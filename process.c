@@ -2,14 +2,34 @@
  * @brief Source file for process management functions
  */
 
+#define _GNU_SOURCE
 #include "process.h"
+#include "admission.h"
+#include "affinity.h"
+#include "bgmap.h"
+#include "capture.h"
+#include "event.h"
+#include "history.h"
+#include "jobqueue.h"
+#include "jobtable.h"
 #include "list.h"
+#include "metrics.h"
+#include "pathcache.h"
+#include "sampler.h"
+#include "sampool.h"
 #include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -17,50 +37,68 @@
 #define ANSI_COLOR_RED "\x1b[31m"
 #define ANSI_COLOR_GREEN "\x1b[32m"
 #define ANSI_COLOR_YELLOW "\x1b[33m"
+#define ANSI_COLOR_CYAN "\x1b[36m"
 #define ANSI_COLOR_RESET "\x1b[0m"
 
-int MAX_PATH = 100;
-int MAX_LEN = 1000;
 int MSG_LEN = 100;
 
-/* helper function for print_process. parses the stat file
- * for a process and prints the values of the following fields:
- * comm, state, utime, stime, rss, vcsw, ivcsw
- * inputs: line - the line from the stat file
- */
-static void parse_stat(char *line) {
-  char *token = strtok(line, " ");
-  int i = 0;
-  while (token != NULL) {
-    switch (i) {
-    // values here are 1 less than the column number in /proc/[pid]/stat
-    // because the first column is the pid, which was already printed.
-    case 1:
-      printf("comm: %s ", token);
-      break;
-    case 2:
-      printf("state: %s ", token);
-      break;
-    case 13:
-      printf("utime: %s ", token);
-      break;
-    case 14:
-      printf("stime: %s ", token);
-      break;
-    case 23:
-      printf("rss: %s ", token);
-      break;
-    case 39:
-      printf("vcsw: %s ", token);
-      break;
-    case 40:
-      printf("ivcsw: %s", token);
-      break;
-    }
-    i++;
-    token = strtok(NULL, " ");
+extern char **environ;
+
+static enum spawn_backend backend = PMAN_SPAWN_DEFAULT;
+
+// Background processes, except pipelines which have a group of their own,
+// are started in one process group, so the bulk commands signal all of
+// them (and anything they started) with a single killpg. The group is led
+// by the first of them, 0 until it starts and again once none are left.
+static pid_t job_group = 0;
+static int group_members = 0;
+// how long bgterm and quit wait after SIGTERM before sending SIGKILL, in ms
+static int kill_grace = 3000;
+// how long to wait for processes to die after SIGKILL, in ms
+#define KILL_WAIT_MS 1000
+
+// options for starting a child process
+typedef struct spawn_opts {
+  // environment of the child
+  char **envp;
+  // cpus to pin the child to, NULL to keep PMan's affinity
+  placement_t *place;
+  // become the child's stdin, stdout and stderr, -1 to inherit PMan's
+  int in_fd;
+  int out_fd;
+  int err_fd;
+  // process group to move the child into: 0 for a new group led by the
+  // child, -1 to stay in PMan's group
+  pid_t pgid;
+
+} spawn_opts;
+
+/* sets spawn options to their defaults, inheriting everything from PMan */
+static void init_opts(spawn_opts *opts, char **envp) {
+  opts->envp = envp;
+  opts->place = NULL;
+  opts->in_fd = -1;
+  opts->out_fd = -1;
+  opts->err_fd = -1;
+  opts->pgid = -1;
+}
+
+/* helper function for print_pstats. Reads the number of voluntary and
+ * involuntary context switches of a process from /proc/[pid]/status,
+ * since /proc/[pid]/stat doesn't include them.
+ */
+static void read_switches(int pid, unsigned long *vcsw, unsigned long *ivcsw) {
+  char path[64], line[256];
+  *vcsw = *ivcsw = 0;
+  snprintf(path, sizeof(path), "/proc/%d/status", pid);
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL)
+    return;
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    sscanf(line, "voluntary_ctxt_switches: %lu", vcsw);
+    sscanf(line, "nonvoluntary_ctxt_switches: %lu", ivcsw);
   }
-  printf("\n");
+  fclose(fp);
 }
 
 /*
@@ -70,100 +108,920 @@ static void parse_stat(char *line) {
  * inputs: pid - pid of the process to print
  */
 void print_pstats(int pid) {
-  // parse /proc/[pid]/stat
-  char *path = malloc(MAX_PATH);
-  sprintf(path, "/proc/%d/stat", pid);
-  FILE *fp = fopen(path, "r");
-
-  if (fp == NULL) {
+  pstat_t st;
+  if (read_pstat(pid, &st) == -1) {
     printf("Error: Process %d does not exist\n", pid);
     return;
   }
-
-  char line[MAX_LEN];
-  fgets(line, MAX_LEN, fp);
-  fclose(fp);
-  free(path);
-  printf("pid: %d ", pid);
-  parse_stat(line);
+  unsigned long vcsw, ivcsw;
+  read_switches(pid, &vcsw, &ivcsw);
+  printf("pid: %d comm: (%s) state: %c utime: %lu stime: %lu rss: %ld "
+         "vcsw: %lu ivcsw: %lu\n",
+         pid, st.comm, st.state, st.utime, st.stime, st.rss, vcsw, ivcsw);
 }
 
-/* prints the list of background processes
- * in the format PID : COMMAND where COMMAND is
- * the command used to execute the process
+/* Samples every background process and prints a table of them, with
+ * cpu usage, rss growth and context switch rate computed since the previous
+ * sample. The first sample of a process has no deltas, shown as '-'.
+ * The table is built in one buffer and printed at once.
  */
-void list_processes(plist_t *processes) {
-  if (processes->size > 1) {
-    printf("Background processes (%d):\n", processes->size);
-  } else if (processes->size == 1) {
-    printf("Background process (1):\n");
-  } else {
+void print_all_pstats(plist_t *processes) {
+  if (processes->size == 0) {
     printf("No background processes\n");
     return;
   }
-  process_t *cur = processes->head;
-  while (cur != NULL) {
-    switch (cur->state) {
-    case ACTIVE:
-      printf(ANSI_COLOR_GREEN "  - %d: %s (Active)" ANSI_COLOR_RESET "\n",
-             cur->pid, cur->name);
-      break;
-    case STOPPED:
-      printf(ANSI_COLOR_YELLOW "  - %d: %s (Stopped)" ANSI_COLOR_RESET "\n",
-             cur->pid, cur->name);
-      break;
-    default:
-      break;
+  sample_all(processes);
+  long page_kb = sysconf(_SC_PAGESIZE) / 1024;
+  int shown = 0;
+  strbuf_t out;
+  sb_init(&out);
+  sb_printf(&out, "%8s %-15s %1s %7s %10s %9s %9s\n", "PID", "COMM", "S",
+            "CPU%", "RSS(KiB)", "dRSS", "CSW/s");
+  for (process_t *cur = processes->head; cur != NULL; cur = cur->next) {
+    job_stats *stats = cur->stats;
+    if (stats == NULL || stats->samples == 0)
+      continue;
+    shown++;
+    sb_printf(&out, "%8d %-15s %c ", cur->pid, stats->cur.comm,
+              stats->cur.state);
+    if (stats->samples < 2) {
+      sb_printf(&out, "%7s %10ld %9s %9s\n", "-", stats->cur.rss * page_kb,
+                "-", "-");
+    } else {
+      sb_printf(&out, "%7.1f %10ld %+9ld %9.1f\n", stats_cpu(stats, 1),
+                stats->cur.rss * page_kb, stats_rss_growth(stats, 1),
+                stats_switch_rate(stats, 1));
     }
-    cur = cur->next;
   }
+  // large lists are sampled in the background, see sampool.c
+  if (shown == 0 && pool_busy())
+    sb_printf(&out, "Sampling %d processes in the background, run pstat "
+                    "again for their stats\n",
+              processes->size);
+  fwrite(out.data, 1, out.len, stdout);
+  sb_free(&out);
 }
 
-/* Forks a child process and executes the command specified by args.
- * If the command is invalid, the child prints an error message and exits.
- * Otherwise, the parent adds the forked child process to the list of processes.
- * Args is expected to contain the command to run at index 0, and the arguments
- * for said command at indices starting at 1. Returns the value of the fork()
- * command. "add" identifies if this is a foreground or background process
+static const char *list_sort_names[] = {"pid", "start", "cpu", "rss"};
+// order list_processes sorts by, for compare_rows
+static enum list_sort list_sort_by;
+
+/* sets bglist options to their defaults: every process, by pid, as text */
+void init_list_opts(list_opts *opts) {
+  opts->state = -1;
+  opts->match = NULL;
+  opts->sort = LIST_PID;
+  opts->per_page = 0;
+  opts->page = 1;
+  opts->json = 0;
+}
+
+/* Parses the options of bglist:
+ *   -s active|stopped  only processes in that state
+ *   -m text            only processes whose command contains text
+ *   -o pid|start|cpu|rss  sort by pid, start time, cpu usage or rss
+ *   -n count           show count processes per page
+ *   -p page            show that page, starting at 1
+ *   --json             print JSON instead of a list
+ * returns: NULL on success, a description of the error otherwise
  */
-int fork_process(char *args[], plist_t *processes, enum runin type) {
-  int pid = fork();
-  if (pid == 0) {
-    int result = execvp(args[0], args);
-    if (result == -1) {
-      // execvp failed, print error message and exit.
-      // prevents the child process from continuing and
-      // possibly causing fork bombs.
-      char msg[MSG_LEN];
-      sprintf(msg, "Error: Invalid command \"%s\"", args[0]);
-      msg_on_prev_line(msg);
-      exit(-1);
+const char *parse_list_opts(char *args[], list_opts *opts) {
+  static char error[128];
+  for (int i = 0; args[i] != NULL; i++) {
+    char *opt = args[i], *val = args[i + 1];
+    if (strcmp(opt, "--json") == 0) {
+      opts->json = 1;
+      continue;
     }
-  } else if (pid > 0) {
-    // name of the process is the command
-    // and arguments used to start it.
-    // it will not be longer than LINE_MAX,
-    // because LINE_MAX is the maximum amount of
-    // chars that are read from stdin.
-    //
-    char name[LINE_MAX], path[LINE_MAX];
-    clean_buffer(name, LINE_MAX);
-    realpath(args[0], path);
-    if (access(path, X_OK) == 0) {
-      remove_first(args);
-      strcpy(name, path);
+    if (strcmp(opt, "-s") != 0 && strcmp(opt, "-m") != 0 &&
+        strcmp(opt, "-o") != 0 && strcmp(opt, "-n") != 0 &&
+        strcmp(opt, "-p") != 0) {
+      snprintf(error, sizeof(error), "Unknown option \"%.64s\"", opt);
+      return error;
     }
-    concat_strs(name, args, LINE_MAX);
-    if (type == BG) {
-      process_t *new_process = new_node(pid, name, ACTIVE);
-      processes = add_at_end(processes, new_process);
+    if (val == NULL) {
+      snprintf(error, sizeof(error), "Expected a value after %s", opt);
+      return error;
     }
+    i++;
+    if (strcmp(opt, "-s") == 0) {
+      if (strcmp(val, "active") == 0)
+        opts->state = ACTIVE;
+      else if (strcmp(val, "stopped") == 0)
+        opts->state = STOPPED;
+      else
+        return "Invalid state, expected active or stopped";
+    } else if (strcmp(opt, "-m") == 0) {
+      opts->match = val;
+    } else if (strcmp(opt, "-o") == 0) {
+      int sort = 0;
+      while (sort < 4 && strcmp(val, list_sort_names[sort]) != 0)
+        sort++;
+      if (sort == 4)
+        return "Invalid order, expected pid, start, cpu or rss";
+      opts->sort = sort;
+    } else if (atoi(val) <= 0) {
+      snprintf(error, sizeof(error), "Expected a positive number after %s",
+               opt);
+      return error;
+    } else if (strcmp(opt, "-n") == 0) {
+      opts->per_page = atoi(val);
+    } else {
+      opts->page = atoi(val);
+    }
+  }
+  return NULL;
+}
+
+/* value a process is sorted by, see top.c. Processes without samples sort
+ * last.
+ */
+static double list_key(process_t *process) {
+  job_stats *stats = process->stats;
+  switch (list_sort_by) {
+  case LIST_START:
+    return process->start_ns;
+  case LIST_CPU:
+    return stats == NULL || stats->samples == 0 ? 1 : -stats_cpu(stats, 1);
+  case LIST_RSS:
+    return stats == NULL || stats->samples == 0 ? 1 : -stats->cur.rss;
+  default:
+    return process->pid;
+  }
+}
+
+/* qsort comparator, orders processes by ascending list_key then pid */
+static int compare_rows(const void *a, const void *b) {
+  process_t *pa = *(process_t **)a, *pb = *(process_t **)b;
+  double ka = list_key(pa), kb = list_key(pb);
+  if (ka != kb)
+    return (ka > kb) - (ka < kb);
+  return (pa->pid > pb->pid) - (pa->pid < pb->pid);
+}
+
+/* Selects the background processes bglist shows, in order. Processes are
+ * only sampled when sorted by cpu or rss.
+ * returns: the number of processes that match the filters, with them in
+ *          rows (malloc'd, NULL if none match)
+ */
+static int select_rows(plist_t *processes, list_opts *opts,
+                       process_t ***rows) {
+  *rows = NULL;
+  if (processes->size == 0)
+    return 0;
+  *rows = malloc(processes->size * sizeof(process_t *));
+  if (*rows == NULL) {
+    fprintf(stderr, "Error: malloc failed in select_rows");
+    exit(1);
+  }
+  if (opts->sort == LIST_CPU || opts->sort == LIST_RSS)
+    sample_all(processes);
+  int n = 0;
+  for (process_t *cur = processes->head; cur != NULL; cur = cur->next) {
+    if ((opts->state == -1 || (int)cur->state == opts->state) &&
+        (opts->match == NULL || strstr(cur->name, opts->match) != NULL))
+      (*rows)[n++] = cur;
+  }
+  // the list is already in pid order unless pids wrapped around, or
+  // processes were re-adopted, so it is sorted either way.
+  list_sort_by = opts->sort;
+  qsort(*rows, n, sizeof(process_t *), compare_rows);
+  return n;
+}
+
+/* returns the first and one past the last row of the page opts asks for */
+static void page_bounds(list_opts *opts, int n, int *first, int *end) {
+  if (opts->per_page == 0) {
+    *first = 0;
+    *end = n;
+    return;
+  }
+  long start = (long)(opts->page - 1) * opts->per_page;
+  *first = start < n ? start : n;
+  *end = start + opts->per_page < n ? start + opts->per_page : n;
+}
+
+/* Appends the background processes bglist would show to out as the
+ * members of a JSON object: "total" (processes matching the filters),
+ * "page" and "processes", an array with pid, name, state, start time,
+ * pinned cpu and node, and cpu usage and rss in KiB when sorted by them
+ * (null otherwise).
+ */
+void list_json(plist_t *processes, list_opts *opts, strbuf_t *out) {
+  process_t **rows;
+  int n = select_rows(processes, opts, &rows), first, end;
+  page_bounds(opts, n, &first, &end);
+  long page_kb = sysconf(_SC_PAGESIZE) / 1024;
+  sb_printf(out, "\"total\": %d, \"page\": %d, \"processes\": [", n,
+            opts->page);
+  for (int i = first; i < end; i++) {
+    process_t *cur = rows[i];
+    sb_printf(out, "%s{\"pid\": %d, \"name\": ", i == first ? "" : ", ",
+              cur->pid);
+    sb_json_str(out, cur->name);
+    sb_printf(out,
+              ", \"state\": \"%s\", \"start_ns\": %lld, \"cpu\": %d, "
+              "\"node\": %d",
+              cur->state == STOPPED ? "stopped" : "active", cur->start_ns,
+              cur->cpu, cur->node);
+    job_stats *stats = cur->stats;
+    if (stats != NULL && stats->samples > 0 &&
+        (opts->sort == LIST_CPU || opts->sort == LIST_RSS))
+      sb_printf(out, ", \"cpu_pct\": %.1f, \"rss_kb\": %ld}",
+                stats->samples > 1 ? stats_cpu(stats, 1) : 0.0,
+                stats->cur.rss * page_kb);
+    else
+      sb_printf(out, ", \"cpu_pct\": null, \"rss_kb\": null}");
+  }
+  sb_printf(out, "], \"queued\": %d, \"held\": ", queued_jobs()->size);
+  const char *held = admit_check();
+  if (held != NULL)
+    sb_json_str(out, held);
+  else
+    sb_printf(out, "null");
+  free(rows);
+}
+
+/* Prints the background processes, as PID : COMMAND where COMMAND is the
+ * command used to execute the process, filtered, sorted and paged as opts
+ * asks (see parse_list_opts). The output is built in one buffer and
+ * written at once, so listing thousands of processes is a single write.
+ */
+void list_processes(plist_t *processes, list_opts *opts) {
+  strbuf_t out;
+  sb_init(&out);
+  if (opts->json) {
+    sb_printf(&out, "{");
+    list_json(processes, opts, &out);
+    sb_printf(&out, "}\n");
+    fwrite(out.data, 1, out.len, stdout);
+    sb_free(&out);
+    return;
+  }
+
+  process_t **rows;
+  int n = select_rows(processes, opts, &rows), first, end;
+  int filtered = opts->state != -1 || opts->match != NULL;
+  page_bounds(opts, n, &first, &end);
+  if (n == 0) {
+    sb_printf(&out, filtered ? "No matching background processes\n"
+                             : "No background processes\n");
+  } else if (filtered) {
+    sb_printf(&out, "Background process%s (%d of %d):\n",
+              n == 1 ? "" : "es", n, processes->size);
   } else {
-    printf("Error: Fork failed");
+    sb_printf(&out, "Background process%s (%d):\n", n == 1 ? "" : "es", n);
+  }
+
+  int usage = opts->sort == LIST_CPU || opts->sort == LIST_RSS;
+  long page_kb = sysconf(_SC_PAGESIZE) / 1024;
+  char place[32], use[48];
+  for (int i = first; i < end; i++) {
+    process_t *cur = rows[i];
+    // processes pinned by the placement policy show where they run.
+    place[0] = '\0';
+    if (cur->cpu >= 0)
+      snprintf(place, sizeof(place), " [cpu %d]", cur->cpu);
+    else if (cur->node >= 0)
+      snprintf(place, sizeof(place), " [node %d]", cur->node);
+    // and when sorted by usage, the usage.
+    use[0] = '\0';
+    if (usage && cur->stats != NULL && cur->stats->samples > 0)
+      snprintf(use, sizeof(use), " %.1f%% %ld KiB",
+               cur->stats->samples > 1 ? stats_cpu(cur->stats, 1) : 0.0,
+               cur->stats->cur.rss * page_kb);
+    if (cur->state == STOPPED)
+      sb_printf(&out,
+                ANSI_COLOR_YELLOW "  - %d: %s (Stopped)%s%s" ANSI_COLOR_RESET
+                                  "\n",
+                cur->pid, cur->name, place, use);
+    else
+      sb_printf(&out,
+                ANSI_COLOR_GREEN "  - %d: %s (Active)%s%s" ANSI_COLOR_RESET
+                                 "\n",
+                cur->pid, cur->name, place, use);
+  }
+  if (opts->per_page > 0 && n > 0) {
+    int pages = (n + opts->per_page - 1) / opts->per_page;
+    if (first == end)
+      sb_printf(&out, "Page %d is past the last page (%d)\n", opts->page,
+                pages);
+    else
+      sb_printf(&out, "Page %d of %d, processes %d-%d of %d\n", opts->page,
+                pages, first + 1, end, n);
+  }
+  fwrite(out.data, 1, out.len, stdout);
+  sb_free(&out);
+  free(rows);
+}
+
+/* prints the jobs waiting in the bgqueue with their queue positions,
+ * in the order they will be started, and why admission control holds
+ * them if it does.
+ * inputs: queue - the queued jobs
+ *         max_running - max number of background processes running at once
+ */
+void list_queue(plist_t *queue, int max_running) {
+  if (queue->size == 0)
+    return;
+  printf("Queued processes (%d), at most %d running:\n", queue->size,
+         max_running);
+  const char *held = admit_check();
+  if (held != NULL)
+    printf("  Held by admission control: %s\n", held);
+  int position = 1;
+  for (process_t *cur = queue->head; cur != NULL; cur = cur->next) {
+    if (cur->batch_left > 0)
+      printf(ANSI_COLOR_CYAN "  - #%d: %s (Queued, %d instance%s from index "
+                             "%d)" ANSI_COLOR_RESET "\n",
+             position++, cur->name, cur->batch_left,
+             cur->batch_left == 1 ? "" : "s", cur->batch_index);
+    else
+      printf(ANSI_COLOR_CYAN "  - #%d: %s (Queued)" ANSI_COLOR_RESET "\n",
+             position++, cur->name);
+  }
+}
+
+/* selects how fork_process creates child processes */
+void set_spawn_backend(enum spawn_backend new_backend) { backend = new_backend; }
+
+/* fork() + execve() backend. The child reports a failed exec by writing
+ * errno to a close-on-exec pipe, so the parent reads either the error or
+ * EOF once the exec succeeded, and no error output comes from the child.
+ * inputs: path - absolute path of the executable
+ *         args - command and arguments to execute
+ *         opts - environment, affinity, file descriptors and process group
+ *                of the child
+ *         err - set to the exec error if the exec failed
+ * returns: pid of the child, -1 if it couldn't be started
+ */
+static pid_t launch_fork(const char *path, char *args[], spawn_opts *opts,
+                         int *err) {
+  int err_pipe[2];
+  if (pipe2(err_pipe, O_CLOEXEC) == -1) {
+    *err = errno;
+    return -1;
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    // PMan blocks SIGCHLD to read it from a signalfd,
+    // the mask is inherited so it must be cleared before exec.
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    if (opts->place != NULL)
+      sched_setaffinity(0, sizeof(cpu_set_t), &opts->place->set);
+    // a child that can't join its process group fails like a failed exec,
+    // as posix_spawn does.
+    if (opts->pgid != -1 && setpgid(0, opts->pgid) == -1) {
+      int e = errno;
+      write(err_pipe[1], &e, sizeof(e));
+      _exit(127);
+    }
+    if (opts->in_fd != -1)
+      dup2(opts->in_fd, STDIN_FILENO);
+    if (opts->out_fd != -1)
+      dup2(opts->out_fd, STDOUT_FILENO);
+    if (opts->err_fd != -1)
+      dup2(opts->err_fd, STDERR_FILENO);
+    close(err_pipe[0]);
+    execve(path, args, opts->envp);
+    // execve failed, report the error and exit.
+    // prevents the child process from continuing and
+    // possibly causing fork bombs.
+    int e = errno;
+    write(err_pipe[1], &e, sizeof(e));
+    _exit(127);
+  }
+  close(err_pipe[1]);
+  if (pid == -1) {
+    *err = errno;
+    close(err_pipe[0]);
+    return -1;
+  }
+  int n;
+  while ((n = read(err_pipe[0], err, sizeof(*err))) == -1 && errno == EINTR)
+    ;
+  close(err_pipe[0]);
+  if (n == sizeof(*err)) {
+    // reap the failed child here so it never shows up as an exit.
+    waitpid(pid, NULL, 0);
+    return -1;
+  }
+  return pid;
+}
+
+/* posix_spawn() backend. Exec failures are returned by posix_spawn
+ * itself, and the failed child has already been reaped.
+ * inputs: path - absolute path of the executable
+ *         args - command and arguments to execute
+ *         opts - environment, affinity, file descriptors and process group
+ *                of the child
+ *         err - set to the exec error if the exec failed
+ * returns: pid of the child, -1 if it couldn't be started
+ */
+static pid_t launch_spawn(const char *path, char *args[], spawn_opts *opts,
+                          int *err) {
+  static posix_spawnattr_t attr;
+  static int attr_ready = 0;
+  // children start with an empty signal mask, see launch_fork.
+  sigset_t mask;
+  sigemptyset(&mask);
+  if (!attr_ready) {
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+    attr_ready = 1;
+  }
+  // the shared attributes are used unless the child changes process group
+  posix_spawnattr_t group_attr, *spawn_attr = &attr;
+  if (opts->pgid != -1) {
+    posix_spawnattr_init(&group_attr);
+    posix_spawnattr_setsigmask(&group_attr, &mask);
+    posix_spawnattr_setpgroup(&group_attr, opts->pgid);
+    posix_spawnattr_setflags(&group_attr,
+                             POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETPGROUP);
+    spawn_attr = &group_attr;
+  }
+  // posix_spawn has no affinity attribute, but children inherit the
+  // affinity of their parent when they are created. So PMan briefly takes
+  // on the child's affinity, and the child starts on the right cpus.
+  cpu_set_t own;
+  if (opts->place != NULL) {
+    sched_getaffinity(0, sizeof(own), &own);
+    sched_setaffinity(0, sizeof(cpu_set_t), &opts->place->set);
+  }
+  posix_spawn_file_actions_t actions, *file_actions = NULL;
+  if (opts->in_fd != -1 || opts->out_fd != -1 || opts->err_fd != -1) {
+    posix_spawn_file_actions_init(&actions);
+    if (opts->in_fd != -1)
+      posix_spawn_file_actions_adddup2(&actions, opts->in_fd, STDIN_FILENO);
+    if (opts->out_fd != -1)
+      posix_spawn_file_actions_adddup2(&actions, opts->out_fd, STDOUT_FILENO);
+    if (opts->err_fd != -1)
+      posix_spawn_file_actions_adddup2(&actions, opts->err_fd, STDERR_FILENO);
+    file_actions = &actions;
+  }
+  pid_t pid;
+  *err = posix_spawn(&pid, path, file_actions, spawn_attr, args, opts->envp);
+  if (file_actions != NULL)
+    posix_spawn_file_actions_destroy(file_actions);
+  if (spawn_attr != &attr)
+    posix_spawnattr_destroy(spawn_attr);
+  if (opts->place != NULL)
+    sched_setaffinity(0, sizeof(own), &own);
+  return *err ? -1 : pid;
+}
+
+/* starts the executable at path with the selected backend */
+static pid_t launch_path(const char *path, char *args[], spawn_opts *opts,
+                         int *err) {
+  if (backend == SPAWN_FORK)
+    return launch_fork(path, args, opts, err);
+  return launch_spawn(path, args, opts, err);
+}
+
+/* starts args with the selected backend, see launch_fork. The command is
+ * resolved through the path cache, so commands that can't be executed
+ * fail without creating a child at all. Counts the spawn or failure, and
+ * records how long a successful one took.
+ */
+static pid_t launch(char *args[], spawn_opts *opts, int *err) {
+  long long start = monotonic_ns();
+  const char *path = resolve_command(args[0]);
+  pid_t pid = -1;
+  // a child writing to PMan's stdout would otherwise get ahead of what
+  // PMan printed before it, which batch mode only flushes once per loop
+  if (path != NULL && (opts->out_fd == -1 || opts->err_fd == -1))
+    fflush(stdout);
+  if (path == NULL)
+    *err = errno;
+  else
+    pid = launch_path(path, args, opts, err);
+  // like execvp, a file without a #! line or a binary format the kernel
+  // knows is run as a /bin/sh script
+  if (pid == -1 && *err == ENOEXEC) {
+    static char shell[] = "/bin/sh";
+    int n = 0;
+    while (args[n] != NULL)
+      n++;
+    char *sh_args[n + 2];
+    sh_args[0] = shell;
+    sh_args[1] = (char *)path;
+    memcpy(sh_args + 2, args + 1, n * sizeof(char *));
+    pid = launch_path(shell, sh_args, opts, err);
+  }
+  if (pid == -1) {
+    metric_inc(M_EXEC_FAILS);
+  } else {
+    // both backends only return once the exec has succeeded
+    metric_inc(M_SPAWNS);
+    metric_record(H_SPAWN, monotonic_ns() - start);
+  }
+  return pid;
+}
+
+/* Returns /dev/null opened for reading, the stdin of background
+ * processes. They run outside the terminal's foreground group, so reading
+ * the terminal would stop them with SIGTTIN, while PMan still lists them
+ * as active. Opened once, -1 if it can't be (they then inherit stdin).
+ */
+static int null_input() {
+  static int fd = -2;
+  if (fd == -2)
+    fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  return fd;
+}
+
+/* starts a background process in the background process group, with
+ * /dev/null as stdin, capturing its output into a log if capture is
+ * enabled. See launch.
+ */
+static pid_t launch_job(char *args[], spawn_opts *opts, int *err) {
+  int child_fd = -1, pipe_fd = -1;
+  if (capture_enabled())
+    pipe_fd = capture_open(&child_fd);
+  opts->in_fd = null_input();
+  opts->out_fd = child_fd;
+  opts->err_fd = child_fd;
+  opts->pgid = job_group;
+  pid_t pid = launch(args, opts, err);
+  // the group is gone if every process in it moved to another group
+  // (setsid), then this process starts a new one.
+  if (pid == -1 && *err == EPERM && job_group != 0) {
+    job_group = opts->pgid = 0;
+    pid = launch(args, opts, err);
+  }
+  if (pid != -1 && job_group == 0)
+    job_group = pid;
+  // only the child keeps the write end open, so PMan sees EOF
+  // once the child (and anything it started) exits.
+  if (child_fd != -1)
+    close(child_fd);
+  if (pipe_fd != -1) {
+    if (pid != -1)
+      capture_attach(pipe_fd, pid);
+    else
+      capture_cancel(pipe_fd);
+  }
+  return pid;
+}
+
+/* adds a newly started background process to the list, recording
+ * where it was placed.
+ */
+static void add_job(plist_t *processes, pid_t pid, char *name,
+                    placement_t *place) {
+  process_t *new_process = new_node(pid, name, ACTIVE);
+  new_process->grouped = 1;
+  new_process->start_ns = boottime_ns();
+  group_members++;
+  if (place != NULL) {
+    new_process->cpu = place->cpu;
+    new_process->node = place->node;
+  }
+  add_at_end(processes, new_process);
+  jt_add(new_process);
+}
+
+/* removes a background process from the job table and the process list,
+ * leaving the background process group once the last one is gone.
+ */
+static void forget_job(plist_t *processes, process_t *process, int status,
+                       const struct rusage *usage) {
+  hist_add(process, status, usage);
+  if (process->map != 0)
+    map_job_done(process, status);
+  if (process->grouped && --group_members == 0)
+    job_group = 0;
+  jt_remove(process);
+  remove_by_pid(processes, process->pid);
+}
+
+/* returns a description of why a command couldn't be started, err is the
+ * error of start_process
+ */
+const char *start_error(int err) {
+  if (err == ERR_PIPELINE)
+    return "Invalid pipeline, expected a command around \"|\"";
+  if (err == ENOENT || err == EACCES || err == ENOEXEC || err == ENOTDIR)
+    return "Invalid command";
+  return strerror(err);
+}
+
+/* prints the error message for a command that couldn't be started */
+void launch_error(char *cmd, int err) {
+  if (err == ERR_PIPELINE)
+    printf("Error: %s\n", start_error(err));
+  else if (err == ENOENT || err == EACCES || err == ENOEXEC || err == ENOTDIR)
+    printf("Error: Invalid command \"%s\"\n", cmd);
+  else
+    printf("Error: Failed to start \"%s\": %s\n", cmd, strerror(err));
+}
+
+/* builds the name a background process is listed with: the command
+ * and arguments used to start it. It will not be longer than LINE_MAX,
+ * because LINE_MAX is the maximum amount of chars that are read from stdin.
+ * Commands given as a path are stored with their absolute path,
+ * commands found through $PATH are stored as typed.
+ */
+static void job_name(char *args[], char name[LINE_MAX]) {
+  const char *path;
+  name[0] = '\0';
+  if (strchr(args[0], '/') != NULL &&
+      (path = resolve_command(args[0])) != NULL) {
+    strncpy(name, path, LINE_MAX - 1);
+    name[LINE_MAX - 1] = '\0';
+    args++;
+  }
+  if (args[0] != NULL)
+    concat_strs(name, args, LINE_MAX);
+}
+
+/* returns the number of stages of a command, separated by "|" */
+static int count_stages(char *args[]) {
+  int stages = 1;
+  for (int i = 0; args[i] != NULL; i++)
+    stages += strcmp(args[i], "|") == 0;
+  return stages;
+}
+
+/* sets the size of a pipe between pipeline stages to $PMAN_PIPE_SIZE
+ * bytes, if set. Larger pipes let stages run further ahead of each other.
+ */
+static void set_pipe_size(int fd) {
+  static int size = -1;
+  if (size == -1) {
+    char *env = getenv("PMAN_PIPE_SIZE");
+    size = env != NULL ? atoi(env) : 0;
+  }
+  if (size > 0)
+    fcntl(fd, F_SETPIPE_SZ, size);
+}
+
+/* Starts a pipeline of commands separated by "|" tokens in args, with the
+ * stdout of every stage connected to the stdin of the next by a pipe.
+ * The stages write straight into each other's pipes, so no data passes
+ * through PMan. A background pipeline is tracked as a single job in its
+ * own process group led by the first stage, with the other stages as
+ * aliases of the job, and its output captured like any background process.
+ * If a stage can't be started, the stages already started are killed.
+ * returns: the pid of the first stage for background pipelines, of the
+ *          last stage for foreground ones, -1 if the pipeline didn't start
+ *          (see start_process for err and failed)
+ */
+static int launch_pipeline(char *args[], plist_t *processes,
+                           enum runin type, int *err, char **failed) {
+  char name[LINE_MAX];
+  job_name(args, name);
+
+  // split args into the argument lists of the stages
+  int nstages = count_stages(args), n = 0;
+  char ***stages = malloc(nstages * sizeof(char **));
+  pid_t *pids = malloc(nstages * sizeof(pid_t));
+  if (stages == NULL || pids == NULL) {
+    fprintf(stderr, "Error: malloc failed in launch_pipeline");
+    exit(1);
+  }
+  stages[n++] = args;
+  for (int i = 0; args[i] != NULL; i++) {
+    if (strcmp(args[i], "|") == 0) {
+      args[i] = NULL;
+      stages[n++] = &args[i + 1];
+    }
+  }
+  for (int i = 0; i < nstages; i++) {
+    if (stages[i][0] == NULL) {
+      *err = ERR_PIPELINE;
+      free(stages);
+      free(pids);
+      return -1;
+    }
+  }
+
+  spawn_opts opts;
+  placement_t place;
+  init_opts(&opts, environ);
+  int child_fd = -1, capture_fd = -1;
+  if (type == BG) {
+    if (choose_placement(processes, &place))
+      opts.place = &place;
+    if (capture_enabled())
+      capture_fd = capture_open(&child_fd);
+  }
+
+  int started = 0, in_fd = -1;
+  for (int i = 0; i < nstages; i++) {
+    int next[2] = {-1, -1};
+    *failed = stages[i][0];
+    if (i < nstages - 1) {
+      if (pipe2(next, O_CLOEXEC) == -1) {
+        *err = errno;
+        break;
+      }
+      set_pipe_size(next[1]);
+    }
+    // the first stage of a background pipeline reads /dev/null, see
+    // null_input
+    opts.in_fd = i == 0 && type == BG ? null_input() : in_fd;
+    opts.out_fd = i < nstages - 1 ? next[1] : child_fd;
+    opts.err_fd = child_fd;
+    if (type == BG)
+      opts.pgid = i == 0 ? 0 : pids[0];
+    pids[i] = launch(stages[i], &opts, err);
+    // the stages hold their own copies of the pipe ends now
+    if (in_fd != -1)
+      close(in_fd);
+    if (next[1] != -1)
+      close(next[1]);
+    in_fd = next[0];
+    if (pids[i] == -1)
+      break;
+    started++;
+  }
+  if (in_fd != -1)
+    close(in_fd);
+  if (child_fd != -1)
+    close(child_fd);
+  free(stages);
+
+  if (started < nstages) {
+    for (int i = 0; i < started; i++) {
+      kill(pids[i], SIGKILL);
+      if (type == FG)
+        waitpid(pids[i], NULL, 0);
+    }
+    if (capture_fd != -1)
+      capture_cancel(capture_fd);
+    free(pids);
+    return -1;
+  }
+
+  if (type == FG) {
+    // PMan waits for the last stage, the others are reaped when they exit.
+    pid_t last = pids[nstages - 1];
+    free(pids);
+    return last;
+  }
+  if (capture_fd != -1)
+    capture_attach(capture_fd, pids[0]);
+  process_t *job = new_node(pids[0], name, ACTIVE);
+  job->pgid = pids[0];
+  job->start_ns = boottime_ns();
+  job->stages = pids;
+  job->nstages = nstages;
+  job->alive = nstages;
+  if (opts.place != NULL) {
+    job->cpu = place.cpu;
+    job->node = place.node;
+  }
+  add_at_end(processes, job);
+  for (int i = 1; i < nstages; i++)
+    add_alias(processes, pids[i], job);
+  jt_add(job);
+  return pids[0];
+}
+
+/* Starts a child process executing the command specified by args, using
+ * the selected spawn backend, without printing anything. The child process
+ * is added to the list of processes if it runs in the background.
+ * Args is expected to contain the command to run at index 0, and the arguments
+ * for said command at indices starting at 1. "type" identifies if this is a
+ * foreground or background process. Commands containing "|" are started as
+ * a pipeline, see launch_pipeline.
+ * returns: the pid of the child, or -1 if it couldn't be started, with the
+ *          error (see start_error) in err and the command that failed in
+ *          failed.
+ */
+int start_process(char *args[], plist_t *processes, enum runin type, int *err,
+                  char **failed) {
+  *err = 0;
+  *failed = args[0];
+  if (count_stages(args) > 1)
+    return launch_pipeline(args, processes, type, err, failed);
+
+  placement_t place;
+  spawn_opts opts;
+  init_opts(&opts, environ);
+  // only background processes are placed and have their output captured
+  if (type == BG && choose_placement(processes, &place))
+    opts.place = &place;
+  pid_t pid = type == BG ? launch_job(args, &opts, err)
+                         : launch(args, &opts, err);
+  if (pid == -1)
+    return -1;
+
+  if (type == BG) {
+    char name[LINE_MAX];
+    job_name(args, name);
+    add_job(processes, pid, name, opts.place);
   }
   return pid;
 }
 
+/* Starts a child process like start_process, printing an error message
+ * if the command is invalid. Returns the pid of the child, or -1 if it
+ * couldn't be started.
+ */
+int fork_process(char *args[], plist_t *processes, enum runin type) {
+  int err;
+  char *failed;
+  int pid = start_process(args, processes, type, &err, &failed);
+  if (pid == -1)
+    launch_error(failed, err);
+  return pid;
+}
+
+/* Starts 'count' background instances of the command specified by args,
+ * without printing anything. The command is only parsed and named once,
+ * then the instances are spawned in a tight loop. Each instance gets its
+ * index (first to first + count - 1) in the PMAN_INDEX environment
+ * variable. Stops at the first instance that fails to start, since the
+ * rest would fail the same way, or when admission control holds new
+ * background processes (see admission.c).
+ * inputs: first_pid, last_pid - set to the pids of the first and last
+ *                               instance started
+ *         err - set to the error of the instance that failed to start,
+ *               0 if the rest were held
+ * returns: the number of instances started
+ */
+int start_batch(char *args[], int first, int count, plist_t *processes,
+                pid_t *first_pid, pid_t *last_pid, int *err) {
+  // the environment of the instances is PMan's own, minus any inherited
+  // PMAN_INDEX, plus a PMAN_INDEX entry rewritten for every instance.
+  int n_env = 0;
+  while (environ[n_env] != NULL)
+    n_env++;
+  char **envp = malloc((n_env + 2) * sizeof(char *));
+  if (envp == NULL) {
+    fprintf(stderr, "Error: malloc failed in start_batch");
+    exit(1);
+  }
+  int j = 0;
+  for (int i = 0; i < n_env; i++) {
+    if (strncmp(environ[i], "PMAN_INDEX=", 11) != 0)
+      envp[j++] = environ[i];
+  }
+  char index_var[32];
+  envp[j++] = index_var;
+  envp[j] = NULL;
+
+  char name[LINE_MAX];
+  job_name(args, name);
+
+  int started = 0;
+  *err = 0;
+  *first_pid = *last_pid = -1;
+  placement_t place;
+  spawn_opts opts;
+  init_opts(&opts, envp);
+  for (int i = first; i < first + count && admit_check() == NULL; i++) {
+    snprintf(index_var, sizeof(index_var), "PMAN_INDEX=%d", i);
+    opts.place = choose_placement(processes, &place) ? &place : NULL;
+    pid_t pid = launch_job(args, &opts, err);
+    if (pid == -1)
+      break;
+    add_job(processes, pid, name, opts.place);
+    if (*first_pid == -1)
+      *first_pid = pid;
+    *last_pid = pid;
+    started++;
+  }
+  free(envp);
+  return started;
+}
+
+/* Starts 'count' background instances of the command specified by args,
+ * like start_batch, with indexes 0 to count - 1. Instances held by
+ * admission control wait in the bgqueue, and are started from there as
+ * pressure drops.
+ * returns: the number of instances started
+ */
+int fork_batch(char *args[], int count, plist_t *processes) {
+  if (count_stages(args) > 1) {
+    printf("Error: bgn doesn't support pipelines\n");
+    return 0;
+  }
+  int err;
+  pid_t first, last;
+  int started = start_batch(args, 0, count, processes, &first, &last, &err);
+  if (err != 0)
+    launch_error(args[0], err);
+
+  char name[LINE_MAX];
+  job_name(args, name);
+  if (started)
+    printf("Started %d instance%s of \"%s\" (pids %d-%d)\n", started,
+           started == 1 ? "" : "s", name, first, last);
+  if (err == 0 && started < count) {
+    queue_push_batch(args, started, count - started);
+    printf("Held %d instance%s of \"%s\" in the queue: %s\n",
+           count - started, count - started == 1 ? "" : "s", name,
+           held_reason());
+  }
+  return started;
+}
+
 /* Sends a signal to a child process. Prints an error message if
  * the provided pid does not correspond to a child process in processes.
  * In the case of a SIGKILL, also removes the process from the
@@ -179,81 +1037,445 @@ void send_signal(plist_t *processes, int pid, int sig) {
     return;
   }
 
-  process_t *process;
-  if (contains_pid(processes, pid) == 0) {
+  if (signal_job(processes, pid, sig) == -1) {
     printf("Error: Process \"%d\" doesn't exist or was not started by PMan\n",
            pid);
+    return;
+  }
+  switch (sig) {
+  case SIGKILL:
+    printf(ANSI_COLOR_RED "Killed process %d" ANSI_COLOR_RESET "\n", pid);
+    break;
+  case SIGSTOP:
+    printf(ANSI_COLOR_YELLOW "Stopped process %d" ANSI_COLOR_RESET "\n", pid);
+    break;
+  case SIGCONT:
+    printf(ANSI_COLOR_GREEN "Started process %d" ANSI_COLOR_RESET "\n", pid);
+    break;
+  }
+}
+
+/* sends sig to a background process, or every stage of a pipeline that
+ * hasn't been reaped yet.
+ */
+static void deliver(process_t *process, int sig) {
+  metric_inc(M_SIGNALS);
+  if (process->pgid > 0) {
+    killpg(process->pgid, sig);
+  } else if (process->stages == NULL) {
+    kill(process->pid, sig);
   } else {
-    kill(pid, sig);
-    switch (sig) {
-    case SIGKILL:
-      remove_by_pid(processes, pid);
-      printf(ANSI_COLOR_RED "Killed process %d" ANSI_COLOR_RESET "\n", pid);
-      break;
-    case SIGSTOP:
-      printf(ANSI_COLOR_YELLOW "Stopped process %d" ANSI_COLOR_RESET "\n", pid);
-      process = get_process(processes, pid);
-      process->state = STOPPED;
-      break;
-    case SIGCONT:
-      printf(ANSI_COLOR_GREEN "Started process %d" ANSI_COLOR_RESET "\n", pid);
-      process = get_process(processes, pid);
-      process->state = ACTIVE;
-      break;
+    for (int i = 0; i < process->nstages; i++) {
+      if (process->stages[i] != 0)
+        kill(process->stages[i], sig);
     }
   }
 }
 
-/* sends SIGKILL to all child processes in the processes list */
-void kill_all(plist_t *processes) {
-  process_t *cur = processes->head;
-  while (cur != NULL) {
-    send_signal(processes, cur->pid, SIGKILL);
-    cur = cur->next;
+/* records the effect of sig on a background process: its state for
+ * SIGSTOP and SIGCONT, and removing it from the process list for SIGKILL.
+ */
+static void signalled(plist_t *processes, process_t *process, int sig) {
+  switch (sig) {
+  case SIGKILL:
+    // it is reaped later without being tracked, so its usage isn't known
+    forget_job(processes, process, SIGKILL, NULL);
+    break;
+  case SIGSTOP:
+    process->state = STOPPED;
+    jt_update(process);
+    break;
+  case SIGCONT:
+    process->state = ACTIVE;
+    jt_update(process);
+    break;
   }
 }
 
-/* Prints an exit message for a process and removes the process from the
- * list of processes. Basically a wrapper function for common code
- * in check_processes.
+/* Sends a signal to a background process like send_signal, without
+ * printing anything, updating the process' state for SIGSTOP and SIGCONT
+ * and removing it from the process list for SIGKILL.
+ * returns: 0 on success, -1 if pid isn't a background process
+ */
+int signal_job(plist_t *processes, int pid, int sig) {
+  process_t *process = get_process(processes, pid);
+  if (process == NULL)
+    return -1;
+  deliver(process, sig);
+  signalled(processes, process, sig);
+  return 0;
+}
+
+/* Sends sig to every background process with a pid from lo to hi, without
+ * recording its effect. When that is every background process, the
+ * background process group is signalled at once, and only the processes
+ * outside of it (pipelines and re-adopted processes) one by one.
+ */
+static void deliver_range(plist_t *processes, pid_t lo, pid_t hi, int sig) {
+  int whole = lo <= 1 && hi == INT_MAX && group_members > 0;
+  if (whole) {
+    metric_inc(M_SIGNALS);
+    killpg(job_group, sig);
+  }
+  for (process_t *cur = processes->head; cur != NULL; cur = cur->next) {
+    if (cur->pid >= lo && cur->pid <= hi && !(whole && cur->grouped))
+      deliver(cur, sig);
+  }
+}
+
+/* Sends a signal to every background process with a pid from lo to hi,
+ * like signal_job.
+ * returns: the number of processes signalled
+ */
+int signal_range(plist_t *processes, pid_t lo, pid_t hi, int sig) {
+  deliver_range(processes, lo, hi, sig);
+  int count = 0;
+  process_t *cur = processes->head, *next;
+  // SIGKILL frees the process, so the next one is found first
+  for (; cur != NULL; cur = next) {
+    next = cur->next;
+    if (cur->pid >= lo && cur->pid <= hi) {
+      signalled(processes, cur, sig);
+      count++;
+    }
+  }
+  return count;
+}
+
+/* Sends a signal to every background process with a pid from lo to hi,
+ * printing how many were signalled. See signal_range.
+ */
+void send_signal_range(plist_t *processes, pid_t lo, pid_t hi, int sig) {
+  int count = signal_range(processes, lo, hi, sig);
+  const char *s = count == 1 ? "" : "es";
+  switch (sig) {
+  case SIGKILL:
+    printf(ANSI_COLOR_RED "Killed %d process%s" ANSI_COLOR_RESET "\n", count,
+           s);
+    break;
+  case SIGSTOP:
+    printf(ANSI_COLOR_YELLOW "Stopped %d process%s" ANSI_COLOR_RESET "\n",
+           count, s);
+    break;
+  case SIGCONT:
+    printf(ANSI_COLOR_GREEN "Started %d process%s" ANSI_COLOR_RESET "\n",
+           count, s);
+    break;
+  }
+}
+
+/* Parses the target of a bulk signal: a pid, a range of pids "first-last"
+ * or "all", into the range of pids lo to hi.
+ * returns: 0 on success, -1 if arg isn't a target
+ */
+int parse_target(const char *arg, pid_t *lo, pid_t *hi) {
+  if (strcmp(arg, "all") == 0) {
+    *lo = 1;
+    *hi = INT_MAX;
+    return 0;
+  }
+  char *end;
+  long first = strtol(arg, &end, 10), last = first;
+  if (end != arg && *end == '-')
+    last = strtol(end + 1, &end, 10);
+  if (end == arg || *end != '\0' || first <= 0 || last < first ||
+      last > INT_MAX)
+    return -1;
+  *lo = first;
+  *hi = last;
+  return 0;
+}
+
+/* adds the resource usage of a reaped stage to the usage of its pipeline */
+static void add_usage(process_t *process, struct rusage *usage) {
+  if (process->usage == NULL) {
+    process->usage = calloc(1, sizeof(struct rusage));
+    if (process->usage == NULL) {
+      fprintf(stderr, "Error: calloc failed in add_usage");
+      exit(1);
+    }
+  }
+  struct rusage *sum = process->usage;
+  timeradd(&sum->ru_utime, &usage->ru_utime, &sum->ru_utime);
+  timeradd(&sum->ru_stime, &usage->ru_stime, &sum->ru_stime);
+  // the stages run at the same time, so their peaks add up
+  sum->ru_maxrss += usage->ru_maxrss;
+  sum->ru_minflt += usage->ru_minflt;
+  sum->ru_majflt += usage->ru_majflt;
+}
+
+/* Adds an exit message for a process to out and removes the process
+ * from the list of processes. Basically a wrapper function for common code
+ * in check_processes. A pipeline is reported once all of its stages have
+ * exited, with the status of its last stage like a shell would.
  * inputs: - pid: pid of the process that exited
- *         - msg: message to print
+ *         - status: wait status of the process
+ *         - usage: resource usage of the process, from wait4
  *         - processes - list of processes
- * returns: 1 if the pid was found in the list, 0 otherwise
+ *         - out - buffer the exit message is added to
+ * returns: 1 if a tracked process has finished, 0 otherwise
  */
-static int handle_process_exit(int pid, char *msg, plist_t *processes) {
+static int handle_process_exit(int pid, int status, struct rusage *usage,
+                               plist_t *processes, strbuf_t *out) {
   // if the child that exited is not in the processes list, it
   // means that it was killed from within PMan by bgkill and
   // as such the user has already been notified of the process' termination
-  if (contains_pid(processes, pid)) {
-    char o_msg[MSG_LEN];
-    sprintf(o_msg, "  - Process %d %s", pid, msg);
-    msg_on_prev_line(o_msg);
-    remove_by_pid(processes, pid);
-    return 1;
+  process_t *process = get_process(processes, pid);
+  if (process == NULL)
+    return 0;
+  if (process->stages == NULL || pid == process->stages[process->nstages - 1])
+    process->status = status;
+  // the usage of a pipeline is the sum of its stages'
+  if (process->stages != NULL) {
+    add_usage(process, usage);
+    usage = process->usage;
   }
-  return 0;
+  // a pipeline has exited once every one of its stages has. Reaped stages
+  // are no longer signalled, their pids may be reused.
+  if (--process->alive > 0) {
+    remove_alias(processes, pid);
+    for (int i = 0; i < process->nstages; i++) {
+      if (process->stages[i] == pid)
+        process->stages[i] = 0;
+    }
+    // a reaped first stage would keep its pid in the index, so the
+    // pipeline is listed under the last stage still running instead
+    if (pid == process->pid) {
+      int i = process->nstages - 1;
+      while (process->stages[i] == 0)
+        i--;
+      rekey_node(processes, process, process->stages[i]);
+      capture_rekey(pid, process->pid);
+      jt_update(process);
+    }
+    return 0;
+  }
+  // bgmap reports the progress of its instances instead
+  if (process->map == 0)
+    sb_printf(out, "%s  - Process %d %s", out->len ? "\n" : "", process->pid,
+              WIFSIGNALED(process->status) ? "was killed" : "has exited");
+  forget_job(processes, process, process->status, usage);
+  return 1;
 }
 
 /* checks the state of the program's child processes to see if
- * any have exited or been killed. Prints a message informing of any
- * such events, and removes the according process from the process list.
+ * any have exited or been killed. Every exited child is reaped in a single
+ * pass, and the messages for all of them are printed as one block. Exited
+ * processes are removed from the process list.
  * inputs: processes - list of processes
- * returns: 1 if a tracked process has exited or been killed
- *          0 otherwise
+ * returns: the number of tracked processes that exited or were killed
  */
 int check_processes(plist_t *processes) {
-  int status;
-  // use WNOHANG so waitpid doesn't block
-  int pid = waitpid(-1, &status, WNOHANG);
+  int status, reaped = 0;
+  struct rusage usage;
+  strbuf_t out;
+  sb_init(&out);
+  // use WNOHANG so wait4 doesn't block. wait4 also returns the resource
+  // usage of the child, which is kept in the history (see history.c).
+  int pid = wait4(-1, &status, WNOHANG, &usage);
   while (pid > 0) {
-    if (WIFSIGNALED(status)) {
-      return handle_process_exit(pid, "was killed", processes);
+    metric_inc(M_REAPS);
+    if (ev_wakeup_ns() != 0 && contains_pid(processes, pid))
+      metric_record(H_REAP, monotonic_ns() - ev_wakeup_ns());
+    if (WIFSIGNALED(status) || WIFEXITED(status))
+      reaped += handle_process_exit(pid, status, &usage, processes, &out);
+    pid = wait4(-1, &status, WNOHANG, &usage);
+  }
+  if (out.len > 0)
+    msg_on_prev_line(out.data);
+  sb_free(&out);
+  return reaped;
+}
+
+/* sets how long bgterm and quit give processes to exit after SIGTERM */
+void set_kill_grace(int ms) { kill_grace = ms; }
+
+// background processes terminate_range is waiting for
+typedef struct term_wait {
+  plist_t *processes;
+  pid_t lo, hi;
+  int ep;
+  // pids and pidfds of every stage of the processes, with the pidfd -1
+  // once it has been handled
+  pid_t *pids;
+  int *fds;
+  int n;
+  // SIGCHLD signalfd, only used if some stage couldn't get a pidfd
+  int sigfd;
+  // processes in the range that haven't exited yet
+  int remaining;
+  // exit messages of processes outside the range, which are printed as
+  // usual, and of those in it, which are summed up by the caller instead
+  strbuf_t out;
+  strbuf_t done;
+
+} term_wait;
+
+/* reaps every child that has exited like check_processes, counting the
+ * processes in the range that are done.
+ */
+static void reap_range(term_wait *w) {
+  int status;
+  struct rusage usage;
+  pid_t pid;
+  while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+    metric_inc(M_REAPS);
+    process_t *job = get_process(w->processes, pid);
+    int in_range = job != NULL && job->pid >= w->lo && job->pid <= w->hi;
+    if ((WIFSIGNALED(status) || WIFEXITED(status)) &&
+        handle_process_exit(pid, status, &usage, w->processes,
+                            in_range ? &w->done : &w->out) &&
+        in_range)
+      w->remaining--;
+  }
+}
+
+/* Sleeps until every process in the range has exited or deadline (a
+ * monotonic_ns time) has passed, handling the exits as they come. Any
+ * ready pidfd (or SIGCHLD) wakes PMan to reap every exited child at once.
+ * Re-adopted processes aren't PMan's children, their pidfds alone tell
+ * that they exited.
+ */
+static void wait_range(term_wait *w, long long deadline) {
+  struct epoll_event events[64];
+  long long now;
+  reap_range(w);
+  while (w->remaining > 0 && (now = monotonic_ns()) < deadline) {
+    int n = epoll_wait(w->ep, events, 64, (deadline - now + 999999) / 1000000);
+    if (n == -1 && errno != EINTR)
+      break;
+    for (int i = 0; i < n; i++) {
+      int k = events[i].data.u32;
+      if (k == w->n) {
+        struct signalfd_siginfo info;
+        while (read(w->sigfd, &info, sizeof(info)) > 0)
+          ;
+        continue;
+      }
+      // closing the pidfd also removes it from the epoll set
+      close(w->fds[k]);
+      w->fds[k] = -1;
+      process_t *job = get_process(w->processes, w->pids[k]);
+      if (job != NULL && job->pidfd != -1) {
+        forget_job(w->processes, job, -1, NULL);
+        w->remaining--;
+      }
     }
-    if (WIFEXITED(status)) {
-      return handle_process_exit(pid, "has exited", processes);
+    reap_range(w);
+  }
+}
+
+/* Terminates every background process with a pid from lo to hi: they are
+ * sent SIGTERM (and SIGCONT, so stopped ones act on it), then the ones
+ * still running after the grace period SIGKILL. Every stage of every
+ * process is watched through a pidfd, so PMan sleeps until they exit
+ * rather than polling, and the wait is bounded by the grace period plus
+ * KILL_WAIT_MS however many processes there are.
+ * inputs: processes - list of processes
+ *         lo, hi - range of pids to terminate
+ *         killed - set to the number of processes that needed SIGKILL
+ * returns: the number of processes terminated
+ */
+int terminate_range(plist_t *processes, pid_t lo, pid_t hi, int *killed) {
+  term_wait w = {.processes = processes, .lo = lo, .hi = hi, .ep = -1,
+                 .sigfd = -1};
+  *killed = 0;
+  int stages = 0;
+  for (process_t *cur = processes->head; cur != NULL; cur = cur->next) {
+    if (cur->pid >= lo && cur->pid <= hi) {
+      stages += cur->nstages;
+      w.remaining++;
     }
-    pid = waitpid(-1, &status, WNOHANG);
   }
-  return 0;
+  int targets = w.remaining;
+  if (targets == 0)
+    return 0;
+  w.pids = malloc(stages * sizeof(pid_t));
+  w.fds = malloc(stages * sizeof(int));
+  if (w.pids == NULL || w.fds == NULL) {
+    fprintf(stderr, "Error: malloc failed in terminate_range");
+    exit(1);
+  }
+  sb_init(&w.out);
+  sb_init(&w.done);
+  w.ep = epoll_create1(EPOLL_CLOEXEC);
+
+  // the pidfds are opened before any signal is sent. When PMan runs out
+  // of fds, SIGCHLD wakes it for the children that have none.
+  int unwatched = 0;
+  for (process_t *cur = processes->head; cur != NULL; cur = cur->next) {
+    if (cur->pid < lo || cur->pid > hi)
+      continue;
+    for (int i = 0; i < cur->nstages; i++) {
+      pid_t pid = cur->stages != NULL ? cur->stages[i] : cur->pid;
+      if (pid == 0)
+        continue;
+      int fd = syscall(SYS_pidfd_open, pid, 0);
+      struct epoll_event ev = {.events = EPOLLIN, .data.u32 = w.n};
+      if (fd != -1 && epoll_ctl(w.ep, EPOLL_CTL_ADD, fd, &ev) == 0) {
+        w.pids[w.n] = pid;
+        w.fds[w.n++] = fd;
+      } else {
+        if (fd != -1)
+          close(fd);
+        unwatched++;
+      }
+    }
+  }
+  if (unwatched) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    w.sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    struct epoll_event ev = {.events = EPOLLIN, .data.u32 = w.n};
+    epoll_ctl(w.ep, EPOLL_CTL_ADD, w.sigfd, &ev);
+  }
+
+  deliver_range(processes, lo, hi, SIGTERM);
+  signal_range(processes, lo, hi, SIGCONT);
+  wait_range(&w, monotonic_ns() + kill_grace * 1000000LL);
+  // whatever is left in the range didn't exit in time. It is killed one by
+  // one, which also reaches processes that left the background group, and
+  // with the whole group, which reaches whatever they started.
+  *killed = w.remaining;
+  if (*killed > 0) {
+    for (process_t *cur = processes->head; cur != NULL; cur = cur->next) {
+      if (cur->pid >= lo && cur->pid <= hi)
+        deliver(cur, SIGKILL);
+    }
+    if (lo <= 1 && hi == INT_MAX && group_members > 0)
+      killpg(job_group, SIGKILL);
+    wait_range(&w, monotonic_ns() + KILL_WAIT_MS * 1000000LL);
+  }
+  // processes that still haven't exited are reaped whenever they do, like
+  // after bgkill.
+  process_t *cur = processes->head, *next;
+  for (; cur != NULL; cur = next) {
+    next = cur->next;
+    if (cur->pid >= lo && cur->pid <= hi)
+      forget_job(processes, cur, SIGKILL, NULL);
+  }
+
+  for (int i = 0; i < w.n; i++) {
+    if (w.fds[i] != -1)
+      close(w.fds[i]);
+  }
+  if (w.sigfd != -1)
+    close(w.sigfd);
+  if (w.ep != -1)
+    close(w.ep);
+  if (w.out.len > 0)
+    msg_on_prev_line(w.out.data);
+  sb_free(&w.out);
+  sb_free(&w.done);
+  free(w.pids);
+  free(w.fds);
+  return targets;
+}
+
+/* Terminates every background process at exit, see terminate_range.
+ * returns: the number of processes terminated
+ */
+int kill_all(plist_t *processes, int *killed) {
+  return terminate_range(processes, 1, INT_MAX, killed);
 }
@@ -3,6 +3,7 @@
  */
 
 #include "list.h"
+#include "utils.h"
 
 #ifndef _PROCESS_H_
 #define _PROCESS_H_
@@ -10,12 +11,62 @@
 // identifies where to run a processes: ForeGround(FG) or BackGround(BG)
 enum runin { FG, BG };
 
+// how child processes are created: fork() + execve(), or posix_spawn(),
+// which glibc implements with clone(CLONE_VM | CLONE_VFORK) so the
+// parent's page tables are never copied.
+enum spawn_backend { SPAWN_FORK, SPAWN_POSIX };
+
+// backend used unless changed with set_spawn_backend,
+// can be overridden at build time with -DPMAN_SPAWN_DEFAULT=SPAWN_FORK
+#ifndef PMAN_SPAWN_DEFAULT
+#define PMAN_SPAWN_DEFAULT SPAWN_POSIX
+#endif
+
+// order bglist shows background processes in
+enum list_sort { LIST_PID, LIST_START, LIST_CPU, LIST_RSS };
+
+// what bglist shows, see parse_list_opts
+typedef struct list_opts {
+  // only processes in this state, -1 for any
+  int state;
+  // only processes whose command contains this, NULL for any
+  const char *match;
+  enum list_sort sort;
+  // processes per page, 0 to show them all, and the page shown
+  int per_page;
+  int page;
+  int json;
+
+} list_opts;
+
+// error of start_process for a pipeline with an empty stage
+#define ERR_PIPELINE -1
+
 void print_process(int pid);
 void print_pstats(int pid);
-void list_processes(plist_t *processes);
+void print_all_pstats(plist_t *processes);
+void init_list_opts(list_opts *opts);
+const char *parse_list_opts(char *args[], list_opts *opts);
+void list_json(plist_t *processes, list_opts *opts, strbuf_t *out);
+void list_processes(plist_t *processes, list_opts *opts);
+void list_queue(plist_t *queue, int max_running);
+void set_spawn_backend(enum spawn_backend backend);
+int start_process(char *args[], plist_t *processes, enum runin type, int *err,
+                  char **failed);
+const char *start_error(int err);
+void launch_error(char *cmd, int err);
 int fork_process(char *args[], plist_t *processes, enum runin type);
+int start_batch(char *args[], int first, int count, plist_t *processes,
+                pid_t *first_pid, pid_t *last_pid, int *err);
+int fork_batch(char *args[], int count, plist_t *processes);
 void send_signal(plist_t *processes, int pid, int sig);
-void kill_all(plist_t *processes);
+int signal_job(plist_t *processes, int pid, int sig);
+int signal_range(plist_t *processes, pid_t lo, pid_t hi, int sig);
+void send_signal_range(plist_t *processes, pid_t lo, pid_t hi, int sig);
+int parse_target(const char *arg, pid_t *lo, pid_t *hi);
+void set_kill_grace(int ms);
+int terminate_range(plist_t *processes, pid_t lo, pid_t hi, int *killed);
+int kill_all(plist_t *processes, int *killed);
 int check_processes(plist_t *processes);
 
 #endif
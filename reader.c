@@ -0,0 +1,89 @@
+/* @file reader.c
+ * @brief Source file for the buffered line reader used for PMan's input.
+ * Lines are returned in place from the buffer, with the newline replaced by
+ * a null terminator, so reading them doesn't copy or allocate anything.
+ */
+
+#include "reader.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// bytes read at once, the buffer grows only for lines longer than this
+#define READ_SIZE (1 << 16)
+
+/* initializes a line reader for fd */
+void lr_init(linereader_t *lr, int fd) {
+  lr->fd = fd;
+  lr->buf = malloc(READ_SIZE + 1);
+  if (lr->buf == NULL) {
+    fprintf(stderr, "Error: malloc failed in lr_init");
+    exit(1);
+  }
+  lr->start = 0;
+  lr->end = 0;
+  lr->cap = READ_SIZE;
+  lr->eof = 0;
+}
+
+/* Reads more input into the buffer, first moving any partial line left
+ * from the previous read to the front. Lines returned by lr_next before
+ * this call are no longer valid after it.
+ * returns: bytes read, 0 at end of file, -1 on error (errno is set,
+ *          EAGAIN if fd is non blocking and has no input)
+ */
+int lr_fill(linereader_t *lr) {
+  if (lr->start > 0) {
+    memmove(lr->buf, lr->buf + lr->start, lr->end - lr->start);
+    lr->end -= lr->start;
+    lr->start = 0;
+  }
+  if (lr->cap - lr->end < READ_SIZE / 2) {
+    lr->cap *= 2;
+    lr->buf = realloc(lr->buf, lr->cap + 1);
+    if (lr->buf == NULL) {
+      fprintf(stderr, "Error: realloc failed in lr_fill");
+      exit(1);
+    }
+  }
+  ssize_t n;
+  while ((n = read(lr->fd, lr->buf + lr->end, lr->cap - lr->end)) == -1 &&
+         errno == EINTR)
+    ;
+  if (n == 0)
+    lr->eof = 1;
+  if (n > 0)
+    lr->end += n;
+  return n;
+}
+
+/* Returns the next complete line in the buffer without its newline, or
+ * NULL if there is none. Once the end of file was read, the remaining
+ * characters are returned as the last line even without a newline.
+ */
+char *lr_next(linereader_t *lr) {
+  if (lr->start >= lr->end)
+    return NULL;
+  char *line = lr->buf + lr->start;
+  char *newline = memchr(line, '\n', lr->end - lr->start);
+  if (newline == NULL) {
+    if (!lr->eof)
+      return NULL;
+    // the buffer always has room for this terminator
+    newline = lr->buf + lr->end;
+  }
+  *newline = '\0';
+  lr->start = newline - lr->buf + 1;
+  if (lr->start > lr->end)
+    lr->start = lr->end;
+  return line;
+}
+
+/* frees the buffer of a line reader */
+void lr_free(linereader_t *lr) {
+  free(lr->buf);
+  lr->buf = NULL;
+}
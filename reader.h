@@ -0,0 +1,27 @@
+/* @file reader.h
+ * @brief Header file for the buffered line reader used for PMan's input
+ */
+
+#include <stddef.h>
+
+#ifndef _READER_H_
+#define _READER_H_
+
+// reads lines from a file descriptor through a buffer, so every
+// line of a read() is handled, however many lines it returned.
+typedef struct linereader_t {
+  int fd;
+  char *buf;
+  size_t start;
+  size_t end;
+  size_t cap;
+  int eof;
+
+} linereader_t;
+
+void lr_init(linereader_t *lr, int fd);
+int lr_fill(linereader_t *lr);
+char *lr_next(linereader_t *lr);
+void lr_free(linereader_t *lr);
+
+#endif
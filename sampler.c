@@ -0,0 +1,318 @@
+/* @file sampler.c
+ * @brief Source file for the /proc sampler of background processes.
+ * Keeps /proc/[pid]/stat and /proc/[pid]/schedstat open for every
+ * background process and re-reads them with pread, parsing the fields in
+ * place without allocating, so all processes can be sampled cheaply.
+ */
+
+#define _GNU_SOURCE
+#include "sampler.h"
+#include "list.h"
+#include "sampool.h"
+#include "utils.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// /proc/[pid]/stat is a few hundred bytes, even with a 15 char comm.
+#define STAT_LEN 1024
+#define SCHED_LEN 128
+
+/* parses an unsigned decimal number starting at p, stopping at end
+ * or the first non digit character.
+ */
+static unsigned long parse_ul(const char *p, const char *end) {
+  unsigned long n = 0;
+  while (p < end && *p >= '0' && *p <= '9')
+    n = n * 10 + (*p++ - '0');
+  return n;
+}
+
+/* Parses the contents of a /proc/[pid]/stat file.
+ * comm is found by the first '(' and the *last* ')', since comm itself
+ * may contain spaces and parentheses. Every field after it is separated
+ * by a single space, and is identified by its column number.
+ * inputs: buf - contents of the stat file, not null terminated
+ *         len - length of buf
+ *         st - where the parsed fields are stored
+ * returns: 0 on success, -1 if buf isn't a valid stat line
+ */
+int parse_stat(const char *buf, int len, pstat_t *st) {
+  const char *open = memchr(buf, '(', len);
+  const char *close = memrchr(buf, ')', len);
+  if (open == NULL || close == NULL || close < open)
+    return -1;
+  int comm_len = close - open - 1;
+  if (comm_len > (int)sizeof(st->comm) - 1)
+    comm_len = sizeof(st->comm) - 1;
+  memcpy(st->comm, open + 1, comm_len);
+  st->comm[comm_len] = '\0';
+
+  const char *p = close + 1, *end = buf + len;
+  // comm is column 2, so the first field after it is column 3 (state)
+  int field = 2;
+  while (p < end && field < 24) {
+    while (p < end && *p == ' ')
+      p++;
+    if (p >= end || *p == '\n')
+      break;
+    field++;
+    switch (field) {
+    case 3:
+      st->state = *p;
+      break;
+    case 10:
+      st->minflt = parse_ul(p, end);
+      break;
+    case 12:
+      st->majflt = parse_ul(p, end);
+      break;
+    case 14:
+      st->utime = parse_ul(p, end);
+      break;
+    case 15:
+      st->stime = parse_ul(p, end);
+      break;
+    case 22:
+      st->starttime = parse_ul(p, end);
+      break;
+    case 24:
+      st->rss = parse_ul(p, end);
+      break;
+    }
+    while (p < end && *p != ' ' && *p != '\n')
+      p++;
+  }
+  return field == 24 ? 0 : -1;
+}
+
+/* parses the number of timeslices (times the process was switched onto a
+ * cpu) from /proc/[pid]/schedstat: "run_time wait_time timeslices"
+ */
+static unsigned long parse_schedstat(const char *buf, int len) {
+  const char *p = buf, *end = buf + len;
+  for (int spaces = 0; p < end && spaces < 2; p++)
+    spaces += *p == ' ';
+  return parse_ul(p, end);
+}
+
+/* rereads an already open /proc file from the start.
+ * returns: the number of bytes read, -1 on error (e.g. the process is gone)
+ */
+static int reread(int fd, char *buf, int size) {
+  return pread(fd, buf, size, 0);
+}
+
+/* opens /proc/[pid]/[file] for rereading */
+static int open_proc(int pid, const char *file) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/%s", pid, file);
+  return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+/* Reads /proc/[pid]/stat of any process once, without the context
+ * switches from schedstat.
+ * returns: 0 on success, -1 if the process doesn't exist
+ */
+int read_stat(int pid, pstat_t *st) {
+  char buf[STAT_LEN];
+  int fd = open_proc(pid, "stat");
+  if (fd == -1)
+    return -1;
+  int len = reread(fd, buf, STAT_LEN);
+  close(fd);
+  st->nswitch = 0;
+  return len <= 0 || parse_stat(buf, len, st) == -1 ? -1 : 0;
+}
+
+/* Reads the stat fields of any process once, without keeping files open.
+ * returns: 0 on success, -1 if the process doesn't exist
+ */
+int read_pstat(int pid, pstat_t *st) {
+  char buf[SCHED_LEN];
+  if (read_stat(pid, st) == -1)
+    return -1;
+
+  int len, fd = open_proc(pid, "schedstat");
+  if (fd != -1) {
+    len = reread(fd, buf, SCHED_LEN);
+    if (len > 0)
+      st->nswitch = parse_schedstat(buf, len);
+    close(fd);
+  }
+  return 0;
+}
+
+/* Rereads the already open /proc/[pid]/stat and schedstat of a process.
+ * inputs: stat_fd, sched_fd - the open files, sched_fd may be -1
+ *         st - where the fields are stored
+ * returns: 0 on success, -1 if the process couldn't be read
+ */
+int reread_pstat(int stat_fd, int sched_fd, pstat_t *st) {
+  char buf[STAT_LEN];
+  int len = reread(stat_fd, buf, STAT_LEN);
+  if (len <= 0 || parse_stat(buf, len, st) == -1)
+    return -1;
+  st->nswitch = 0;
+  if (sched_fd != -1 && (len = reread(sched_fd, buf, SCHED_LEN)) > 0)
+    st->nswitch = parse_schedstat(buf, len);
+  return 0;
+}
+
+/* returns the sampling state of a process, creating it on first use */
+static job_stats *get_stats(process_t *process) {
+  if (process->stats == NULL) {
+    process->stats = calloc(1, sizeof(job_stats));
+    if (process->stats == NULL) {
+      fprintf(stderr, "Error: calloc failed in get_stats");
+      exit(1);
+    }
+    process->stats->stat_fd = -1;
+    process->stats->sched_fd = -1;
+  }
+  return process->stats;
+}
+
+/* Adds a sample of a background process, taken at now_ns (monotonic), to
+ * the process' ring of recent samples used for computing deltas.
+ */
+void stats_record(process_t *process, const pstat_t *st, long long now_ns) {
+  job_stats *stats = get_stats(process);
+  stats->cur = *st;
+  sample_t *sample = &stats->ring[stats->samples % SAMPLE_RING];
+  sample->ns = now_ns;
+  sample->utime = st->utime;
+  sample->stime = st->stime;
+  sample->nswitch = st->nswitch;
+  sample->rss = st->rss;
+  stats->samples++;
+}
+
+/* Takes a new sample of a background process, adding it to the process'
+ * ring of recent samples. Opens the process' /proc files on the first
+ * sample.
+ * inputs: process - the process to sample
+ *         now_ns - monotonic time of the sample
+ * returns: 0 on success, -1 if the process couldn't be read
+ */
+int sample_process(process_t *process, long long now_ns) {
+  job_stats *stats = get_stats(process);
+  if (stats->stat_fd == -1) {
+    stats->stat_fd = open_proc(process->pid, "stat");
+    if (stats->stat_fd == -1)
+      return -1;
+    stats->sched_fd = open_proc(process->pid, "schedstat");
+  }
+  pstat_t st;
+  if (reread_pstat(stats->stat_fd, stats->sched_fd, &st) == -1)
+    return -1;
+  stats_record(process, &st, now_ns);
+  return 0;
+}
+
+/* Samples every background process in the list, all with the same
+ * timestamp. Large lists are sampled by the sampler threads instead, see
+ * sampool.c, and get the latest samples they published.
+ * returns: the number of processes sampled
+ */
+int sample_all(plist_t *processes) {
+  int sampled = pool_sample_all(processes);
+  if (sampled != -1)
+    return sampled;
+  long long now = monotonic_ns();
+  sampled = 0;
+  for (process_t *cur = processes->head; cur != NULL; cur = cur->next)
+    sampled += sample_process(cur, now) == 0;
+  return sampled;
+}
+
+/* closes the /proc files PMan's own thread keeps open for a process, once
+ * it's sampled by the sampler threads instead
+ */
+void stats_close(job_stats *stats) {
+  if (stats->stat_fd != -1)
+    close(stats->stat_fd);
+  if (stats->sched_fd != -1)
+    close(stats->sched_fd);
+  stats->stat_fd = -1;
+  stats->sched_fd = -1;
+}
+
+/* closes the /proc files of a process and frees its sampling state */
+void release_stats(job_stats *stats) {
+  if (stats == NULL)
+    return;
+  stats_close(stats);
+  free(stats);
+}
+
+/* returns the sample taken 'back' samples before the newest one
+ * (0 is the newest), or NULL if it is no longer or not yet in the ring.
+ */
+sample_t *stats_sample(job_stats *stats, int back) {
+  if (stats == NULL || back < 0 || back >= SAMPLE_RING ||
+      back >= stats->samples)
+    return NULL;
+  return &stats->ring[(stats->samples - 1 - back) % SAMPLE_RING];
+}
+
+/* finds the newest sample and the one 'span' samples before it, clamping
+ * span to the history that is available.
+ * returns: the seconds between the two, 0 if there is only one sample
+ */
+static double sample_span(job_stats *stats, int span, sample_t **newest,
+                          sample_t **oldest) {
+  if (stats == NULL || stats->samples < 2)
+    return 0;
+  if (span > stats->samples - 1)
+    span = stats->samples - 1;
+  if (span > SAMPLE_RING - 1)
+    span = SAMPLE_RING - 1;
+  *newest = stats_sample(stats, 0);
+  *oldest = stats_sample(stats, span);
+  return ((*newest)->ns - (*oldest)->ns) / 1e9;
+}
+
+/* cpu usage (user + system) over the last 'span' sample intervals, in
+ * percent of one cpu. returns -1 if there aren't two samples yet.
+ */
+double stats_cpu(job_stats *stats, int span) {
+  sample_t *a, *b;
+  double dt = sample_span(stats, span, &a, &b);
+  if (dt <= 0)
+    return -1;
+  unsigned long ticks = (a->utime + a->stime) - (b->utime + b->stime);
+  return 100.0 * ticks / sysconf(_SC_CLK_TCK) / dt;
+}
+
+/* change in resident set size over the last 'span' sample intervals, in KiB */
+long stats_rss_growth(job_stats *stats, int span) {
+  sample_t *a, *b;
+  if (sample_span(stats, span, &a, &b) <= 0)
+    return 0;
+  return (a->rss - b->rss) * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/* context switches per second over the last 'span' sample intervals,
+ * returns -1 if there aren't two samples yet.
+ */
+double stats_switch_rate(job_stats *stats, int span) {
+  sample_t *a, *b;
+  double dt = sample_span(stats, span, &a, &b);
+  if (dt <= 0)
+    return -1;
+  return (a->nswitch - b->nswitch) / dt;
+}
+
+/* highest resident set size of the samples in the ring, in KiB */
+long stats_peak_rss(job_stats *stats) {
+  long peak = 0;
+  sample_t *sample;
+  for (int i = 0; (sample = stats_sample(stats, i)) != NULL; i++) {
+    if (sample->rss > peak)
+      peak = sample->rss;
+  }
+  return peak * (sysconf(_SC_PAGESIZE) / 1024);
+}
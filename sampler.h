@@ -0,0 +1,69 @@
+/* @file sampler.h
+ * @brief Header file for the /proc sampler of background processes
+ */
+
+#include "list.h"
+
+#ifndef _SAMPLER_H_
+#define _SAMPLER_H_
+
+// fields of /proc/[pid]/stat (and schedstat) PMan reports on.
+// comm is truncated like the kernel does, to 15 chars.
+typedef struct pstat_t {
+  char comm[16];
+  char state;
+  unsigned long minflt;
+  unsigned long majflt;
+  unsigned long utime;
+  unsigned long stime;
+  long rss;
+  unsigned long nswitch;
+  // clock ticks since boot the process started at
+  unsigned long long starttime;
+
+} pstat_t;
+
+// number of recent samples kept per process
+#define SAMPLE_RING 16
+
+// one entry of the sample history of a process
+typedef struct sample_t {
+  long long ns;
+  unsigned long utime;
+  unsigned long stime;
+  unsigned long nswitch;
+  long rss;
+
+} sample_t;
+
+// sampling state of a background process. The /proc files stay open
+// between samples so re-reading them is a single pread each. They are -1
+// while the process is sampled by the sampler threads, which keep their
+// own. cur holds
+// every field of the latest sample, ring the history of the counters,
+// with the newest at ring[(samples - 1) % SAMPLE_RING].
+typedef struct job_stats {
+  int stat_fd;
+  int sched_fd;
+  int samples;
+  pstat_t cur;
+  sample_t ring[SAMPLE_RING];
+
+} job_stats;
+
+int parse_stat(const char *buf, int len, pstat_t *st);
+int read_stat(int pid, pstat_t *st);
+int read_pstat(int pid, pstat_t *st);
+int reread_pstat(int stat_fd, int sched_fd, pstat_t *st);
+void stats_record(process_t *process, const pstat_t *st, long long now_ns);
+int sample_process(process_t *process, long long now_ns);
+int sample_all(plist_t *processes);
+void stats_close(job_stats *stats);
+void release_stats(job_stats *stats);
+sample_t *stats_sample(job_stats *stats, int back);
+double stats_cpu(job_stats *stats, int span);
+long stats_rss_growth(job_stats *stats, int span);
+double stats_switch_rate(job_stats *stats, int span);
+long stats_peak_rss(job_stats *stats);
+
+#endif
@@ -0,0 +1,367 @@
+/* @file sampool.c
+ * @brief Source file for the sampler threads. Reading /proc for tens of
+ * thousands of background processes takes long enough to freeze the
+ * prompt, so once there are POOL_MIN_PROCESSES of them, sample_all hands
+ * the reading to a pool of threads and never waits for it.
+ *
+ * A round of sampling works on two snapshot buffers. PMan's own thread
+ * fills the back buffer with the pid and start time of every background
+ * process and wakes each thread through its own semaphore. Each thread
+ * samples the pids that hash to it, into their entries of the back buffer,
+ * with /proc files it keeps open itself, so the threads share nothing. The
+ * last thread to finish publishes the back buffer as the front one with an
+ * atomic store. PMan applies the front buffer to its processes, without
+ * locks, the next time sample_all is called, then starts the next round in
+ * the other buffer.
+ * Only PMan's thread starts rounds, and only after it is done reading the
+ * front buffer, so the buffer a round writes to is never being read.
+ */
+
+#define _GNU_SOURCE
+#include "sampool.h"
+#include "sampler.h"
+#include "utils.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// lists smaller than this are sampled by PMan's own thread, which takes
+// well under a millisecond for them
+#define POOL_MIN_PROCESSES 256
+#define MAX_THREADS 8
+
+// a background process to sample, and its sample once the round is done
+typedef struct snap_entry {
+  pid_t pid;
+  // 1 if st holds a sample
+  int ok;
+  // start time of the process, so a sample isn't applied to another
+  // process that got the same pid
+  long long start_ns;
+  pstat_t st;
+
+} snap_entry;
+
+// samples of every background process, taken in one round
+typedef struct snapshot {
+  // monotonic time the round started, which every sample is taken at
+  long long ns;
+  int n;
+  int capacity;
+  snap_entry *entries;
+
+} snapshot;
+
+// /proc files a thread keeps open for a pid
+typedef struct fd_slot {
+  pid_t pid;
+  int stat_fd;
+  int sched_fd;
+  // last round the pid was sampled in
+  unsigned round;
+
+} fd_slot;
+
+// open addressing table of a thread's open files, capacity a power of two
+typedef struct fd_table {
+  fd_slot *slots;
+  int capacity;
+  int used;
+
+} fd_table;
+
+typedef struct worker {
+  pthread_t thread;
+  int index;
+  // posted once to start a round, or to stop. Each thread has its own, so
+  // a fast one can't take another's post and run twice in one round.
+  sem_t start_round;
+  fd_table files;
+
+} worker;
+
+static int n_threads = -1;
+static worker *workers = NULL;
+static int started = 0;
+static atomic_int stopping;
+// threads still sampling the current round
+static atomic_int pending;
+// 1 from when a round starts until its snapshot is published
+static atomic_int busy;
+static snapshot buffers[2];
+// the snapshot published last, NULL before the first round is done
+static _Atomic(snapshot *) front = NULL;
+// the snapshot the current or next round writes to
+static snapshot *back = &buffers[0];
+// the snapshot last applied to the processes
+static snapshot *applied = NULL;
+static unsigned round_number = 0;
+
+/* sets the number of sampler threads, 0 samples every list on PMan's own
+ * thread. Only takes effect before the threads are started.
+ */
+void pool_set_threads(int n) {
+  if (!started)
+    n_threads = n > MAX_THREADS ? MAX_THREADS : n;
+}
+
+/* returns the number of sampler threads, by default the number of online
+ * cpus (at most MAX_THREADS)
+ */
+static int thread_count() {
+  if (n_threads < 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    n_threads = cpus < 1 ? 1 : cpus > MAX_THREADS ? MAX_THREADS : cpus;
+  }
+  return n_threads;
+}
+
+/* finds the slot of pid in a thread's table, or the empty slot it belongs
+ * in
+ */
+static fd_slot *find_slot(fd_table *files, pid_t pid) {
+  uint32_t mask = files->capacity - 1, i = (uint32_t)pid * 2654435761u & mask;
+  while (files->slots[i].pid != 0 && files->slots[i].pid != pid)
+    i = (i + 1) & mask;
+  return &files->slots[i];
+}
+
+/* Rebuilds a thread's table at a capacity that fits its pids. With sweep,
+ * only the pids sampled in the current round are kept, and the files of
+ * the rest are closed.
+ */
+static void rebuild_table(fd_table *files, int sweep) {
+  fd_slot *old = files->slots;
+  int old_capacity = files->capacity, live = 0;
+  for (int i = 0; i < old_capacity; i++) {
+    if (old[i].pid != 0 && (!sweep || old[i].round == round_number))
+      live++;
+  }
+  files->capacity = 64;
+  while (files->capacity < live * 2 + 2)
+    files->capacity *= 2;
+  files->slots = calloc(files->capacity, sizeof(fd_slot));
+  if (files->slots == NULL) {
+    fprintf(stderr, "Error: calloc failed in rebuild_table");
+    exit(1);
+  }
+  files->used = live;
+  for (int i = 0; i < old_capacity; i++) {
+    if (old[i].pid == 0)
+      continue;
+    if (!sweep || old[i].round == round_number) {
+      *find_slot(files, old[i].pid) = old[i];
+    } else {
+      close(old[i].stat_fd);
+      if (old[i].sched_fd != -1)
+        close(old[i].sched_fd);
+    }
+  }
+  free(old);
+}
+
+/* opens /proc/[pid]/[file] for rereading */
+static int open_proc(pid_t pid, const char *file) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/%s", pid, file);
+  return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+/* samples one process into its entry, opening its files on first use.
+ * A process that can't be read has its files closed.
+ */
+static void sample_entry(fd_table *files, snap_entry *entry) {
+  if (2 * (files->used + 1) > files->capacity)
+    rebuild_table(files, 0);
+  fd_slot *slot = find_slot(files, entry->pid);
+  if (slot->pid == 0) {
+    int fd = open_proc(entry->pid, "stat");
+    if (fd == -1)
+      return;
+    slot->pid = entry->pid;
+    slot->stat_fd = fd;
+    slot->sched_fd = open_proc(entry->pid, "schedstat");
+    files->used++;
+  }
+  slot->round = round_number;
+  entry->ok = reread_pstat(slot->stat_fd, slot->sched_fd, &entry->st) == 0;
+  // a process that is gone is dropped from the table by the next sweep
+  if (!entry->ok)
+    slot->round--;
+}
+
+/* sampler thread, samples the pids that hash to it every round, and
+ * publishes the round if it's the last to finish.
+ */
+static void *sampler_thread(void *data) {
+  worker *self = data;
+  fd_table *files = &self->files;
+  while (1) {
+    while (sem_wait(&self->start_round) == -1)
+      ;
+    if (atomic_load(&stopping))
+      break;
+    snapshot *snap = back;
+    for (int i = 0; i < snap->n; i++) {
+      if (snap->entries[i].pid % n_threads == self->index)
+        sample_entry(files, &snap->entries[i]);
+    }
+    rebuild_table(files, 1);
+    // the samples written above are visible to whoever sees busy drop
+    if (atomic_fetch_sub(&pending, 1) == 1) {
+      atomic_store(&front, snap);
+      atomic_store(&busy, 0);
+    }
+  }
+  for (int i = 0; i < files->capacity; i++) {
+    if (files->slots[i].pid != 0) {
+      close(files->slots[i].stat_fd);
+      if (files->slots[i].sched_fd != -1)
+        close(files->slots[i].sched_fd);
+    }
+  }
+  free(files->slots);
+  return NULL;
+}
+
+/* starts the sampler threads, with every signal blocked in them so signals
+ * are still handled by PMan's own thread.
+ * returns: 0 on success, -1 if no thread could be started
+ */
+static int start_threads() {
+  int n = thread_count();
+  workers = calloc(n, sizeof(worker));
+  if (workers == NULL) {
+    fprintf(stderr, "Error: calloc failed in start_threads");
+    exit(1);
+  }
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  int created = 0;
+  for (int i = 0; i < n; i++) {
+    workers[created].index = created;
+    sem_init(&workers[created].start_round, 0, 0);
+    if (pthread_create(&workers[created].thread, NULL, sampler_thread,
+                       &workers[created]) == 0)
+      created++;
+    else
+      sem_destroy(&workers[created].start_round);
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  n_threads = created;
+  started = 1;
+  return created > 0 ? 0 : -1;
+}
+
+/* grows a snapshot to hold n entries */
+static void reserve(snapshot *snap, int n) {
+  if (snap->capacity >= n)
+    return;
+  int capacity = snap->capacity ? snap->capacity : 1024;
+  while (capacity < n)
+    capacity *= 2;
+  snap_entry *grown = realloc(snap->entries, capacity * sizeof(snap_entry));
+  if (grown == NULL) {
+    fprintf(stderr, "Error: realloc failed in reserve");
+    exit(1);
+  }
+  snap->entries = grown;
+  snap->capacity = capacity;
+}
+
+/* Applies the samples of a snapshot to the processes they were taken of.
+ * Processes that have exited since, or whose pid was reused, are skipped.
+ * returns: the number of processes a sample was applied to
+ */
+static int apply(snapshot *snap, plist_t *processes) {
+  int count = 0;
+  for (int i = 0; i < snap->n; i++) {
+    snap_entry *entry = &snap->entries[i];
+    process_t *process = get_process(processes, entry->pid);
+    if (!entry->ok || process == NULL ||
+        process->start_ns != entry->start_ns || process->pid != entry->pid)
+      continue;
+    // the files PMan's thread had open for it are no longer needed
+    if (process->stats != NULL)
+      stats_close(process->stats);
+    stats_record(process, &entry->st, snap->ns);
+    count++;
+  }
+  return count;
+}
+
+/* Samples the background processes on the sampler threads, if there are
+ * enough of them for it to be worth it. Applies the samples of the last
+ * round that finished (if they weren't applied yet), and starts a new
+ * round unless one is still running. Never waits for /proc.
+ * returns: the number of processes a sample was applied to, -1 if the
+ *          processes should be sampled by the caller instead
+ */
+int pool_sample_all(plist_t *processes) {
+  if (processes->size < POOL_MIN_PROCESSES || thread_count() == 0)
+    return -1;
+  if (!started && start_threads() == -1)
+    return -1;
+  // the front snapshot is always applied before a round starts
+  if (atomic_load(&busy))
+    return 0;
+  int count = 0;
+  snapshot *latest = atomic_load(&front);
+  if (latest != NULL && latest != applied) {
+    count = apply(latest, processes);
+    applied = latest;
+  }
+
+  // the next round writes to the buffer that isn't the front one
+  back = latest == &buffers[0] ? &buffers[1] : &buffers[0];
+  reserve(back, processes->size);
+  int n = 0;
+  for (process_t *cur = processes->head; cur != NULL; cur = cur->next) {
+    back->entries[n].pid = cur->pid;
+    back->entries[n].start_ns = cur->start_ns;
+    back->entries[n].ok = 0;
+    n++;
+  }
+  back->n = n;
+  back->ns = monotonic_ns();
+  round_number++;
+  atomic_store(&pending, n_threads);
+  atomic_store(&busy, 1);
+  for (int i = 0; i < n_threads; i++)
+    sem_post(&workers[i].start_round);
+  return count;
+}
+
+/* returns 1 while the sampler threads are sampling */
+int pool_busy() { return started && atomic_load(&busy); }
+
+/* stops the sampler threads, after the round they are sampling, and frees
+ * the snapshots
+ */
+void pool_stop() {
+  if (started) {
+    atomic_store(&stopping, 1);
+    for (int i = 0; i < n_threads; i++)
+      sem_post(&workers[i].start_round);
+    for (int i = 0; i < n_threads; i++) {
+      pthread_join(workers[i].thread, NULL);
+      sem_destroy(&workers[i].start_round);
+    }
+  }
+  free(workers);
+  workers = NULL;
+  started = 0;
+  for (int i = 0; i < 2; i++) {
+    free(buffers[i].entries);
+    buffers[i].entries = NULL;
+    buffers[i].capacity = 0;
+  }
+}
@@ -0,0 +1,15 @@
+/* @file sampool.h
+ * @brief Header file for the sampler threads
+ */
+
+#include "list.h"
+
+#ifndef _SAMPOOL_H_
+#define _SAMPOOL_H_
+
+void pool_set_threads(int n);
+int pool_sample_all(plist_t *processes);
+int pool_busy();
+void pool_stop();
+
+#endif
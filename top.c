@@ -0,0 +1,158 @@
+/* @file top.c
+ * @brief Source file for bgtop, the live view of background processes.
+ * Every interval all background processes are sampled, sorted and the
+ * table is redrawn, with each frame rendered to a buffer and written at
+ * once.
+ */
+
+#include "top.h"
+#include "event.h"
+#include "list.h"
+#include "sampler.h"
+#include "utils.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#define ANSI_CLEAR_SCREEN "\x1b[H\x1b[2J"
+#define ANSI_INVERT "\x1b[7m"
+#define ANSI_COLOR_RESET "\x1b[0m"
+
+// state of the running bgtop, timer_fd is -1 when bgtop isn't running
+static int timer_fd = -1;
+static enum top_sort sort_by;
+static int interval;
+static strbuf_t frame;
+
+static const char *sort_names[] = {"cpu", "rss", "csw"};
+
+/* value a process is sorted by, processes without samples sort last */
+static double sort_key(process_t *process) {
+  job_stats *stats = process->stats;
+  if (stats == NULL || stats->samples == 0)
+    return -2;
+  switch (sort_by) {
+  case SORT_RSS:
+    return stats->cur.rss;
+  case SORT_CSW:
+    return stats_switch_rate(stats, 1);
+  default:
+    return stats_cpu(stats, 1);
+  }
+}
+
+/* qsort comparator, orders processes by descending sort_key */
+static int compare(const void *a, const void *b) {
+  double ka = sort_key(*(process_t **)a), kb = sort_key(*(process_t **)b);
+  return (ka < kb) - (ka > kb);
+}
+
+/* returns the number of rows of the terminal, 24 if it isn't one */
+static int terminal_rows() {
+  struct winsize ws;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 0)
+    return ws.ws_row;
+  return 24;
+}
+
+/* renders one frame of the table into the frame buffer. CPU% and CSW/s
+ * are since the previous frame, AVG% and PEAK are over the whole sample
+ * ring of each process.
+ */
+static void render(plist_t *processes) {
+  frame.len = 0;
+  long page_kb = sysconf(_SC_PAGESIZE) / 1024;
+  sb_printf(&frame,
+            ANSI_CLEAR_SCREEN "bgtop - %d background processes, sorted by %s, "
+                              "every %.1fs (press enter to exit)\n",
+            processes->size, sort_names[sort_by], interval / 1000.0);
+  sb_printf(&frame,
+            ANSI_INVERT "%8s %1s %7s %7s %10s %10s %9s  %-20s" ANSI_COLOR_RESET
+                        "\n",
+            "PID", "S", "CPU%", "AVG%", "RSS(KiB)", "PEAK(KiB)", "CSW/s",
+            "COMMAND");
+  if (processes->size == 0)
+    return;
+
+  process_t **rows = malloc(processes->size * sizeof(process_t *));
+  if (rows == NULL) {
+    fprintf(stderr, "Error: malloc failed in render");
+    exit(1);
+  }
+  int n = 0;
+  for (process_t *cur = processes->head; cur != NULL; cur = cur->next)
+    rows[n++] = cur;
+  qsort(rows, n, sizeof(process_t *), compare);
+
+  // header and column titles take two rows, keep one free for the cursor
+  int max_rows = terminal_rows() - 3;
+  // the "... more" line takes the place of the last row
+  if (n > max_rows)
+    max_rows--;
+  for (int i = 0; i < n && i < max_rows; i++) {
+    job_stats *stats = rows[i]->stats;
+    if (stats == NULL || stats->samples == 0) {
+      sb_printf(&frame, "%8d %1s %7s %7s %10s %10s %9s  %.40s\n", rows[i]->pid,
+                "?", "-", "-", "-", "-", "-", rows[i]->name);
+      continue;
+    }
+    double cpu = stats_cpu(stats, 1), avg = stats_cpu(stats, SAMPLE_RING);
+    double csw = stats_switch_rate(stats, 1);
+    sb_printf(&frame, "%8d %c %7.1f %7.1f %10ld %10ld %9.1f  %.40s\n",
+              rows[i]->pid, stats->cur.state, cpu < 0 ? 0 : cpu,
+              avg < 0 ? 0 : avg, stats->cur.rss * page_kb,
+              stats_peak_rss(stats), csw < 0 ? 0 : csw, rows[i]->name);
+  }
+  if (n > max_rows)
+    sb_printf(&frame, "  ... %d more\n", n - max_rows);
+  free(rows);
+}
+
+/* timer handler, samples all processes and redraws the table */
+static int redraw(int fd, uint32_t events, void *data) {
+  plist_t *processes = data;
+  sample_all(processes);
+  render(processes);
+  // a slow terminal can take less than the whole frame in one write
+  size_t written = 0;
+  while (written < frame.len) {
+    ssize_t n = write(STDOUT_FILENO, frame.data + written, frame.len - written);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    written += n;
+  }
+  return 0;
+}
+
+/* Starts bgtop, redrawing the table every interval_ms milliseconds
+ * until top_stop is called.
+ * returns: 0 on success, -1 if the redraw timer couldn't be created
+ */
+int top_start(plist_t *processes, enum top_sort sort, int interval_ms) {
+  sort_by = sort;
+  interval = interval_ms;
+  timer_fd = ev_timer(interval_ms, redraw, processes);
+  if (timer_fd == -1)
+    return -1;
+  // draw the first frame right away, the deltas fill in on the next one.
+  fflush(stdout);
+  redraw(timer_fd, 0, processes);
+  return 0;
+}
+
+/* returns 1 if bgtop is running, 0 otherwise */
+int top_active() { return timer_fd != -1; }
+
+/* stops bgtop and frees the frame buffer */
+void top_stop() {
+  if (timer_fd == -1)
+    return;
+  ev_timer_stop(timer_fd);
+  timer_fd = -1;
+  sb_free(&frame);
+}
@@ -0,0 +1,17 @@
+/* @file top.h
+ * @brief Header file for bgtop, the live view of background processes
+ */
+
+#include "list.h"
+
+#ifndef _TOP_H_
+#define _TOP_H_
+
+// column the bgtop table is sorted by, highest first
+enum top_sort { SORT_CPU, SORT_RSS, SORT_CSW };
+
+int top_start(plist_t *processes, enum top_sort sort, int interval_ms);
+int top_active();
+void top_stop();
+
+#endif
@@ -3,9 +3,11 @@
  */
 
 #include "utils.h"
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 /* Removes the first element of an array of strings
@@ -20,10 +22,20 @@ void remove_first(char *array[]) {
   }
 }
 
+// when set, output isn't going to a terminal and escapes are left out
+static int plain_output = 0;
+
+/* sets whether messages are printed without terminal escapes */
+void set_plain_output(int plain) { plain_output = plain; }
+
 /* Prints a message on the previous line of the terminal.
  * input: message to print
  */
 void msg_on_prev_line(char *msg) {
+  if (plain_output) {
+    printf("%s\n", msg);
+    return;
+  }
   printf("\n");
   printf("\x1b[1F");
   printf("%c[2K", 27);
@@ -43,39 +55,106 @@ void remove_newline(char *str) {
 /* wipes input string buffer up to 'size' chars */
 void clean_buffer(char *buffer, int size) { memset(buffer, 0, size); }
 
-/* checks if a string consists of only space characters
+/* checks if a string consists of only space and tab characters
  * inputs: str: the string to check
  * output: 1 if the string is all spaces, 0 otherwise
  */
-int all_spaces(char *str) { return strlen(str) == strspn(str, " "); }
+int all_spaces(char *str) { return strlen(str) == strspn(str, " \t"); }
+
+/* appends src to dest, a buffer of 'limit' bytes, truncating it so dest
+ * stays null terminated
+ */
+static void append_bounded(char *dest, const char *src, int limit) {
+  int room = limit - (int)strlen(dest) - 1;
+  if (room > 0)
+    strncat(dest, src, room);
+}
 
-/* concatenates at most 'limit' characters from each string in str_list
- * to dest
+/* concatenates the strings in str_list to dest, separated by spaces.
+ * dest is a buffer of 'limit' bytes, the result is truncated to fit it.
  */
 void concat_strs(char *dest, char *str_list[], int limit) {
   int i = 0;
   if (dest[0] != '\0')
-    strncat(dest, " ", limit);
-  strncat(dest, str_list[i++], limit);
+    append_bounded(dest, " ", limit);
+  append_bounded(dest, str_list[i++], limit);
   while (str_list[i] != NULL) {
-    strncat(dest, " ", limit);
-    strncat(dest, str_list[i++], limit);
+    append_bounded(dest, " ", limit);
+    append_bounded(dest, str_list[i++], limit);
   }
 }
-/*
-void path_search(char* executable, char *result){
-  char* path = getenv("PATH");
-  char* dir = strtok(path, ":");
-  char* temp = malloc(100);
-  while(dir != NULL){
-    strcpy(temp, dir);
-    strcat(temp, "/");
-    strcat(temp, executable);
-    if(access(temp, X_OK) == 0){
-      strcpy(result, temp);
-      free(temp);
-      return;
+/* initializes an empty string buffer */
+void sb_init(strbuf_t *sb) {
+  sb->data = NULL;
+  sb->len = 0;
+  sb->cap = 0;
+}
+
+/* appends printf style formatted output to a string buffer,
+ * growing it as needed. The buffer is always null terminated.
+ */
+void sb_printf(strbuf_t *sb, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(sb->data + sb->len, sb->cap - sb->len, fmt, ap);
+  va_end(ap);
+  if (n < 0)
+    return;
+  if (sb->len + n + 1 > sb->cap) {
+    size_t cap = sb->cap ? sb->cap : 256;
+    while (cap < sb->len + n + 1)
+      cap *= 2;
+    sb->data = realloc(sb->data, cap);
+    if (sb->data == NULL) {
+      fprintf(stderr, "Error: realloc failed in sb_printf");
+      exit(1);
     }
-    dir = strtok(NULL, ":");
+    sb->cap = cap;
+    va_start(ap, fmt);
+    vsnprintf(sb->data + sb->len, sb->cap - sb->len, fmt, ap);
+    va_end(ap);
   }
-}*/
+  sb->len += n;
+}
+
+/* frees the memory held by a string buffer and empties it */
+void sb_free(strbuf_t *sb) {
+  free(sb->data);
+  sb_init(sb);
+}
+
+/* appends str to out as a JSON string, escaping it as needed. Runs of
+ * characters that need no escaping are copied at once.
+ */
+void sb_json_str(strbuf_t *out, const char *str) {
+  sb_printf(out, "\"");
+  while (*str != '\0') {
+    int run = 0;
+    while (str[run] != '\0' && str[run] != '"' && str[run] != '\\' &&
+           (unsigned char)str[run] >= 0x20)
+      run++;
+    sb_printf(out, "%.*s", run, str);
+    str += run;
+    if (*str == '"' || *str == '\\')
+      sb_printf(out, "\\%c", *str++);
+    else if (*str != '\0')
+      sb_printf(out, "\\u%04x", (unsigned char)*str++);
+  }
+  sb_printf(out, "\"");
+}
+
+/* returns the current CLOCK_MONOTONIC time in nanoseconds */
+long long monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* returns the current CLOCK_BOOTTIME in ns, the clock /proc start times
+ * are based on.
+ */
+long long boottime_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_BOOTTIME, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
@@ -1,12 +1,29 @@
+#include <stddef.h>
+
 #ifndef _UTLS_H_
 #define _UTLS_H_
 
+// growable string buffer, used to build up output
+// that is then written all at once.
+typedef struct strbuf_t {
+  char *data;
+  size_t len;
+  size_t cap;
+
+} strbuf_t;
+
 void remove_first(char *args[]);
 void msg_on_prev_line(char *msg);
+void set_plain_output(int plain);
 void remove_newline(char *input);
 int all_spaces(char *str);
 void concat_strs(char *dest, char *str_list[], int limit);
 void clean_buffer(char *buffer, int size);
-//void path_search(char *executable, char *result);
+void sb_init(strbuf_t *sb);
+void sb_printf(strbuf_t *sb, const char *fmt, ...);
+void sb_free(strbuf_t *sb);
+void sb_json_str(strbuf_t *out, const char *str);
+long long monotonic_ns();
+long long boottime_ns();
 
 #endif